@@ -0,0 +1,163 @@
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+// Times every audio callback against its budget, the duration of the block it renders. The audio
+// thread only adds to atomic counters; the message thread reads what accumulated since its last
+// read, so a display shows the recent past without ever stopping the audio thread.
+class CallbackMonitor
+{
+public:
+    // loads are the share of the budget a callback used, so 1.0 is a callback that took a whole block
+    struct Statistics
+    {
+        int numBlocks = 0;
+        double minLoad = 0.0, averageLoad = 0.0, p99Load = 0.0, maxLoad = 0.0;
+
+        // the furthest a callback came from the expected interval
+        double maxJitterMs = 0.0;
+
+        // callbacks that took longer than their block, and callbacks the device made late
+        int numOverruns = 0, numLateCallbacks = 0;
+    };
+
+    // audio thread; times the callback it is created in
+    class ScopedBlock
+    {
+    public:
+        ScopedBlock(CallbackMonitor& monitorToUse, double blockStartTime, int numSamples, double sampleRate)
+            : monitor(monitorToUse), startTime(blockStartTime), budgetMs(1000.0 * numSamples / sampleRate)
+        {
+        }
+
+        ~ScopedBlock()
+        {
+            monitor.record(startTime, Time::getMillisecondCounterHiRes(), budgetMs);
+        }
+
+    private:
+        CallbackMonitor& monitor;
+        const double startTime, budgetMs;
+
+        JUCE_DECLARE_NON_COPYABLE(ScopedBlock)
+    };
+
+    // audio thread; a callback that is not timed, so the next one starts a new interval rather
+    // than counting as late
+    void skipBlock()
+    {
+        lastStartTime = 0.0;
+    }
+
+    // message thread; the statistics of the callbacks since the previous call
+    Statistics collect()
+    {
+        Statistics statistics;
+
+        std::array<uint32, numBins> counts;
+
+        for (size_t i = 0; i < numBins; ++i)
+        {
+            auto total = bins[i].load(std::memory_order_relaxed);
+            counts[i] = total - collectedBins[i];
+            collectedBins[i] = total;
+            statistics.numBlocks += (int) counts[i];
+        }
+
+        auto totalOverruns = numOverruns.load(std::memory_order_relaxed);
+        auto totalLateCallbacks = numLateCallbacks.load(std::memory_order_relaxed);
+        auto totalLoad = loadSum.load(std::memory_order_relaxed);
+
+        statistics.numOverruns = (int) (totalOverruns - collectedOverruns);
+        statistics.numLateCallbacks = (int) (totalLateCallbacks - collectedLateCallbacks);
+
+        // the extremes are handed over by swapping in a neutral value; a callback that writes in
+        // between loses its own extreme, which the next read sees anyway
+        auto minimum = minLoad.exchange(std::numeric_limits<float>::max());
+        auto maximum = maxLoad.exchange(0.0f);
+        auto jitter = maxJitterMs.exchange(0.0f);
+
+        if (statistics.numBlocks > 0)
+        {
+            statistics.minLoad = minimum;
+            statistics.maxLoad = maximum;
+            statistics.averageLoad = (totalLoad - collectedLoad) / statistics.numBlocks;
+            statistics.maxJitterMs = jitter;
+
+            // the upper edge of the bin that holds the 99th percentile, capped by the real maximum
+            auto rank = (uint32) std::ceil(0.99 * statistics.numBlocks);
+            uint32 count = 0;
+
+            for (size_t i = 0; i < numBins; ++i)
+            {
+                count += counts[i];
+
+                if (count >= rank)
+                {
+                    statistics.p99Load = jmin((double) (i + 1) * binWidth, statistics.maxLoad);
+                    break;
+                }
+            }
+        }
+
+        collectedOverruns = totalOverruns;
+        collectedLateCallbacks = totalLateCallbacks;
+        collectedLoad = totalLoad;
+
+        return statistics;
+    }
+
+private:
+    void record(double startTime, double endTime, double budgetMs)
+    {
+        auto load = (float) ((endTime - startTime) / budgetMs);
+        auto bin = jmin((size_t) (load / binWidth), numBins - 1);
+
+        bins[bin].fetch_add(1, std::memory_order_relaxed);
+
+        // a double has no fetch_add before C++20, and this thread is the only writer
+        loadSum.store(loadSum.load(std::memory_order_relaxed) + load, std::memory_order_relaxed);
+
+        if (load > 1.0f)
+            numOverruns.fetch_add(1, std::memory_order_relaxed);
+
+        if (load < minLoad.load(std::memory_order_relaxed))
+            minLoad.store(load, std::memory_order_relaxed);
+
+        if (load > maxLoad.load(std::memory_order_relaxed))
+            maxLoad.store(load, std::memory_order_relaxed);
+
+        // the device should call back once per block; much later means it dropped one itself
+        if (lastStartTime > 0.0)
+        {
+            auto interval = startTime - lastStartTime;
+            auto jitter = (float) std::abs(interval - lastBudgetMs);
+
+            if (jitter > maxJitterMs.load(std::memory_order_relaxed))
+                maxJitterMs.store(jitter, std::memory_order_relaxed);
+
+            if (interval > 1.5 * lastBudgetMs)
+                numLateCallbacks.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        lastStartTime = startTime;
+        lastBudgetMs = budgetMs;
+    }
+
+    // 2 % of the budget per bin, up to twice the budget
+    static constexpr size_t numBins = 100;
+    static constexpr double binWidth = 0.02;
+
+    std::array<std::atomic<uint32>, numBins> bins {};
+    std::atomic<double> loadSum { 0.0 };
+    std::atomic<uint32> numOverruns { 0 }, numLateCallbacks { 0 };
+    std::atomic<float> minLoad { std::numeric_limits<float>::max() }, maxLoad { 0.0f }, maxJitterMs { 0.0f };
+
+    // audio thread only
+    double lastStartTime = 0.0, lastBudgetMs = 0.0;
+
+    // message thread only
+    std::array<uint32, numBins> collectedBins {};
+    uint32 collectedOverruns = 0, collectedLateCallbacks = 0;
+    double collectedLoad = 0.0;
+};
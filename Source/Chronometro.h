@@ -1,35 +1,177 @@
 #pragma once
 
 #include "../JuceLibraryCode/JuceHeader.h"
+#include "CallbackMonitor.h"
+#include "LatencyCalibration.h"
+#include "MidiSync.h"
 #include "Music.h"
+#include "RealtimeCheck.h"
+#include "SharedTransport.h"
 #include "SoundStall.h"
+#include "TraceRecorder.h"
 #include <list>
 
-class BeatAudioSource : public AudioSource, public ChangeBroadcaster
+// A transport command for the audio thread, decoded elsewhere
+struct ControlCommand
+{
+    enum class Type
+    {
+        tempo,
+        start,
+        stop
+    };
+
+    Type type;
+    double value;
+};
+
+// One writer thread, and the audio thread as the only reader. A batch becomes visible as a whole,
+// so its commands are applied within the same block.
+class ControlCommandQueue
+{
+public:
+    bool push(const ControlCommand* commands, int numCommands)
+    {
+        if (numCommands == 0)
+            return true;
+
+        int start1, size1, start2, size2;
+        fifo.prepareToWrite(numCommands, start1, size1, start2, size2);
+
+        if (size1 + size2 < numCommands)
+            return false;
+
+        std::copy_n(commands, size1, queue.begin() + start1);
+        std::copy_n(commands + size1, size2, queue.begin() + start2);
+        fifo.finishedWrite(size1 + size2);
+
+        return true;
+    }
+
+    template <typename Function>
+    void popAll(Function&& function)
+    {
+        int start1, size1, start2, size2;
+        fifo.prepareToRead(fifo.getNumReady(), start1, size1, start2, size2);
+
+        for (auto i = 0; i < size1; ++i)
+            function(queue[(size_t) (start1 + i)]);
+
+        for (auto i = 0; i < size2; ++i)
+            function(queue[(size_t) (start2 + i)]);
+
+        fifo.finishedRead(size1 + size2);
+    }
+
+    bool hasPending() const { return fifo.getNumReady() > 0; }
+
+private:
+    static constexpr int queueSize = 256;
+
+    AbstractFifo fifo { queueSize };
+    std::array<ControlCommand, queueSize> queue;
+};
+
+// Every change of the transport is made on the audio thread, whoever asks for it, so the sound
+// stall and the Metre are only ever touched by one thread. The audio thread cannot post a message
+// without risking a lock, so it raises a flag that a timer hands on as a change message; the timer
+// only runs while a command or a calibration is on its way.
+class BeatAudioSource : public AudioSource, public ChangeBroadcaster, private AsyncUpdater, private Timer
 {
 public:
     BeatAudioSource(Music::Metre& metre) : musicMetre(metre), soundStallProcessor(metre)
     {
     }
 
+    ~BeatAudioSource() override
+    {
+        cancelPendingUpdate();
+        stopTimer();
+    }
+
     void prepareToPlay(int samplesPerBlockExpected, double sampleRate) override
     {
-        musicMetre.audioDeviceSampleRate = sampleRate;
-        musicMetre.init();
+        musicMetre.prepareToPlay(sampleRate);
 
         soundStallProcessor.prepareToPlay(sampleRate, samplesPerBlockExpected);
+
+        currentSampleRate = sampleRate;
+        midiOutputBuffer.ensureSize(4096);
     }
 
     void releaseResources() override {}
 
     void getNextAudioBlock(const AudioSourceChannelInfo& bufferToFill) override
     {
+        const RealtimeCheck::ScopedAudioCallback scopedAudioCallback;
+
+        // stopped with nothing left to finish: the output is silence until a command or the message
+        // thread starts the transport, so nothing else is worth doing or measuring
+        if (isIdle() && !controlQueue.hasPending() && !latencyCalibrator.isRunning())
+        {
+            bufferToFill.clearActiveBufferRegion();
+            callbackMonitor.skipBlock();
+            return;
+        }
+
+        auto blockStartTime = Time::getMillisecondCounterHiRes();
+        const CallbackMonitor::ScopedBlock scopedBlock(callbackMonitor, blockStartTime, bufferToFill.numSamples, currentSampleRate);
+
+        TraceRecorder::setThreadName("Audio Thread");
+        const TraceRecorder::ScopedEvent traceEvent("Audio Callback", bufferToFill.numSamples);
+
+        midiOutputBuffer.clear();
+
+        applyControlCommands();
+
+        if (latencyCalibrator.process(bufferToFill, currentSampleRate))
+        {
+            if (!latencyCalibrator.isRunning())
+                changePending = true;
+
+            return;
+        }
+
         if (stopped)
         {
             bufferToFill.clearActiveBufferRegion();
+
+            if (wasPlaying)
+            {
+                midiClock.stop(midiOutputBuffer);
+                wasPlaying = false;
+
+                if (auto* publisher = transportPublisher.load())
+                    publisher->publishStop();
+            }
         }
         else
         {
+            auto* follower = clockFollower.load();
+
+            if (follower != nullptr)
+                follower->setBaseNoteValue(musicMetre.getPlayingBaseNoteValue());
+
+            auto isFollowerLocked = follower != nullptr && follower->isLocked();
+
+            // a start or a new lock joins the master on its beat of the bar, which nudging alone
+            // would take many bars to reach
+            if (isFollowerLocked && (!wasPlaying || !wasFollowerLocked))
+            {
+                double beatPosition;
+
+                if (follower->getBarPosition(blockStartTime, beatPosition))
+                    musicMetre.setPosition(beatPosition);
+            }
+
+            wasFollowerLocked = isFollowerLocked;
+
+            if (!wasPlaying)
+            {
+                midiClock.start(midiOutputBuffer);
+                wasPlaying = true;
+            }
+
             AudioSampleBuffer localBuffer {
                 bufferToFill.buffer->getArrayOfWritePointers(),
                 bufferToFill.buffer->getNumChannels(),
@@ -38,58 +180,322 @@ public:
             };
 
             soundStallProcessor.processBlock(localBuffer, midiBuffer);
+            midiClock.process(midiOutputBuffer, musicMetre, bufferToFill.numSamples, currentSampleRate);
 
-            auto accent = (*musicMetre.currentPulse).getAccent();
-            auto accentProcessor = [&](auto sample) -> auto
-            {
-                return std::tanh((1 + std::log(10 * accent + 1)) * sample);
-            };
+            if (isFollowerLocked)
+                followExternalClock(*follower, blockStartTime);
 
-            if (accent == 0.0f)
-                return;
+            if (auto* publisher = transportPublisher.load())
+                publishTransport(*publisher, blockStartTime);
 
-            for (auto i = 0; i < localBuffer.getNumSamples(); ++i)
-            {
-                for (auto channel = 0; channel < localBuffer.getNumChannels(); ++channel)
-                {
-                    auto* outBuffer = localBuffer.getWritePointer(channel);
-                    outBuffer[i] = accentProcessor(outBuffer[i]);
-                }
-            }
+            updateTransportStatus();
+            recordAudibleBeats(blockStartTime);
+
+            samplePosition += bufferToFill.numSamples;
         }
+
+        midiOutputSender.send(midiOutputBuffer, blockStartTime, bufferToFill.numSamples, currentSampleRate);
     }
 
+    // the audio thread starts at its next block, and the change message follows; a command still
+    // in the queue may yet change the transport, so it is always followed by the one asked for now
     void start()
     {
-        if (stopped)
+        if (stopped || controlQueue.hasPending())
         {
-            musicMetre.update();
-            stopped = false;
-
-            sendChangeMessage();
+            const ControlCommand command { ControlCommand::Type::start, 0.0 };
+            pushControlCommands(&command, 1);
         }
     }
 
     void stop()
     {
-        if (!stopped)
+        if (!stopped || controlQueue.hasPending())
         {
-            stopped = true;
-            soundStallProcessor.reset();
-
-            sendChangeMessage();
+            const ControlCommand command { ControlCommand::Type::stop, 0.0 };
+            pushControlCommands(&command, 1);
         }
     }
 
+    // any thread but the audio thread; false if the queue is full
+    bool pushControlCommands(const ControlCommand* commands, int numCommands)
+    {
+        if (!controlQueue.push(commands, numCommands))
+            return false;
+
+        triggerAsyncUpdate();
+        return true;
+    }
+
+    void startLatencyCalibration()
+    {
+        latencyCalibrator.start();
+        triggerAsyncUpdate();
+    }
+
     bool isPlaying() { return !stopped; }
 
+    // stopped, and the MIDI clock's stop has been sent
+    bool isIdle() const { return stopped && !wasPlaying; }
+
+    void setMidiOutput(std::unique_ptr<MidiOutput> midiOutput) { midiOutputSender.setOutput(std::move(midiOutput)); }
+
+    void setClockFollower(Music::ClockFollower* follower) { clockFollower = follower; }
+    void setTransportPublisher(SharedTransport* publisher) { transportPublisher = publisher; }
+
+    bool hasPendingCommands() const { return controlQueue.hasPending(); }
+
+    // the minutes stopped after which the audio device is closed, 0 keeps it open
+    int getIdleTimeoutMinutes() const { return idleTimeoutMinutes; }
+    void setIdleTimeoutMinutes(int minutes) { idleTimeoutMinutes = jmax(0, minutes); }
+
+    const LatencyCalibrator& getLatencyCalibrator() const { return latencyCalibrator; }
+
+    CallbackMonitor& getCallbackMonitor() { return callbackMonitor; }
+
+    // from the callback to the speaker, either measured or as the device reports it
+    void setOutputLatency(int samples) { outputLatencySamples = samples; }
+    int getOutputLatency() const { return outputLatencySamples; }
+
+    // the number of beats that have been heard by the given time (Time::getMillisecondCounterHiRes),
+    // so a display can light up with the sound rather than when the block was rendered
+    int64 getAudibleBeatCount(double time) const
+    {
+        auto count = beatCount.load(std::memory_order_acquire);
+        auto oldest = jmax((int64) 0, count - (int64) beatTimes.size());
+
+        for (auto i = count; i > oldest; --i)
+            if (beatTimes[(size_t) ((i - 1) % (int64) beatTimes.size())].load(std::memory_order_relaxed) <= time)
+                return i;
+
+        return oldest;
+    }
+
+    struct TransportStatus
+    {
+        int64 bar;
+        double beat;
+        bool playing;
+    };
+
+    // any thread
+    TransportStatus getTransportStatus() const { return { barCount.load(), barPosition.load(), !stopped }; }
+
     AudioProcessorEditor* createEditor() { return soundStallProcessor.createEditor(); }
 
+    AudioProcessorValueTreeState& getValueTreeState() { return soundStallProcessor.getValueTreeState(); }
+
+    void getStateInformation(MemoryBlock& destData) { soundStallProcessor.getStateInformation(destData); }
+    void setStateInformation(const void* data, int sizeInBytes) { soundStallProcessor.setStateInformation(data, sizeInBytes); }
+
+    // the app and the headless engine share one session
+    static File getSessionFile()
+    {
+        return File::getSpecialLocation(File::userApplicationDataDirectory)
+            .getChildFile(ProjectInfo::projectName)
+            .getChildFile("Session.bin");
+    }
+
+    // The settings of the app follow the sound processor's state, marked at the very end, so a
+    // session saved before they were added still loads.
+    void loadSession()
+    {
+        MemoryBlock sessionData;
+
+        if (!getSessionFile().loadFileAsData(sessionData))
+            return;
+
+        const TraceRecorder::ScopedEvent traceEvent("Session Restore", (int64) sessionData.getSize());
+        auto stateSize = sessionData.getSize();
+
+        if (stateSize >= sessionSettingsSize)
+        {
+            MemoryInputStream settings(static_cast<const char*>(sessionData.getData()) + stateSize - sessionSettingsSize, sessionSettingsSize, false);
+            auto minutes = settings.readInt();
+
+            if (settings.readInt() == sessionSettingsMagic)
+            {
+                setIdleTimeoutMinutes(minutes);
+                stateSize -= sessionSettingsSize;
+            }
+        }
+
+        setStateInformation(sessionData.getData(), (int) stateSize);
+    }
+
+    void saveSession()
+    {
+        MemoryBlock sessionData;
+        getStateInformation(sessionData);
+
+        {
+            MemoryOutputStream settings(sessionData, true);
+            settings.writeInt(idleTimeoutMinutes);
+            settings.writeInt(sessionSettingsMagic);
+        }
+
+        auto sessionFile = getSessionFile();
+        sessionFile.getParentDirectory().createDirectory();
+        sessionFile.replaceWithData(sessionData.getData(), sessionData.getSize());
+    }
+
 private:
+    // at the start of a block, so a batch of commands lands on the same sample
+    void applyControlCommands()
+    {
+        // the flag is raised before the commands leave the queue, so a timer that finds the queue
+        // empty also finds the flag
+        controlQueue.popAll([this](const ControlCommand& command) {
+            switch (command.type)
+            {
+                case ControlCommand::Type::tempo:
+                    musicMetre.setBPM((float) command.value);
+                    break;
+
+                case ControlCommand::Type::start:
+                    if (stopped)
+                    {
+                        musicMetre.update();
+                        barCount = 0;
+                        stopped = false;
+                        changePending = true;
+                    }
+
+                    musicMetre.setPosition(command.value);
+                    break;
+
+                case ControlCommand::Type::stop:
+                    if (!stopped)
+                    {
+                        stopped = true;
+                        soundStallProcessor.reset();
+                        changePending = true;
+                    }
+
+                    break;
+            }
+        });
+    }
+
+    // a push wakes the timer on the message thread, which asks for the audio thread's news until
+    // it has nothing more coming
+    void handleAsyncUpdate() override
+    {
+        startTimer(changePollMilliseconds);
+    }
+
+    void timerCallback() override
+    {
+        auto isSettled = !controlQueue.hasPending() && !latencyCalibrator.isRunning();
+
+        if (changePending.exchange(false))
+            sendChangeMessage();
+
+        if (isSettled)
+            stopTimer();
+    }
+
+    void recordAudibleBeats(double blockStartTime)
+    {
+        auto* events = musicMetre.getEvents();
+        auto latencyMs = 1000.0 * outputLatencySamples / currentSampleRate;
+
+        for (auto i = 0; i < musicMetre.getNumEvents(); ++i)
+        {
+            if (!events[i].isBeatStart)
+                continue;
+
+            auto count = beatCount.load(std::memory_order_relaxed);
+            beatTimes[(size_t) (count % (int64) beatTimes.size())] = blockStartTime + 1000.0 * events[i].samplePosition / currentSampleRate + latencyMs;
+            beatCount.store(count + 1, std::memory_order_release);
+        }
+    }
+
+    void updateTransportStatus()
+    {
+        auto* events = musicMetre.getEvents();
+
+        for (auto i = 0; i < musicMetre.getNumEvents(); ++i)
+            if (events[i].isBeatStart && events[i].beat == 0)
+                ++barCount;
+
+        barPosition = musicMetre.getPosition();
+    }
+
+    // pull the beat onsets of this block towards the master's beats; the correction is spread
+    // over the pulse that is currently playing, so nothing is done per sample
+    void followExternalClock(const Music::ClockFollower& follower, double blockStartTime)
+    {
+        auto* events = musicMetre.getEvents();
+
+        for (auto i = 0; i < musicMetre.getNumEvents(); ++i)
+        {
+            if (!events[i].isBeatStart)
+                continue;
+
+            auto onsetTime = blockStartTime + 1000.0 * events[i].samplePosition / currentSampleRate;
+            auto errorInSamples = follower.getPhaseError(onsetTime, events[i].beat) * 0.001 * currentSampleRate;
+
+            musicMetre.nudgeCurrentPulse((float) (-0.5 * errorInSamples));
+        }
+    }
+
+    void publishTransport(SharedTransport& publisher, double blockStartTime)
+    {
+        auto* events = musicMetre.getEvents();
+
+        for (auto i = 0; i < musicMetre.getNumEvents(); ++i)
+        {
+            if (!events[i].isBeatStart)
+                continue;
+
+            publisher.publishBeat(blockStartTime + 1000.0 * events[i].samplePosition / currentSampleRate,
+                                  musicMetre.getBPM(),
+                                  events[i].beat,
+                                  musicMetre.getNumBeats(),
+                                  (int) musicMetre.getPlayingBaseNoteValue(),
+                                  samplePosition + events[i].samplePosition,
+                                  currentSampleRate);
+        }
+    }
+
     Music::Metre& musicMetre;
 
     MidiBuffer midiBuffer;
     SoundStallProcessor soundStallProcessor;
 
-    bool stopped { true };
+    MidiBuffer midiOutputBuffer;
+    MidiClockGenerator midiClock;
+    MidiOutputSender midiOutputSender;
+
+    std::atomic<Music::ClockFollower*> clockFollower { nullptr };
+    std::atomic<SharedTransport*> transportPublisher { nullptr };
+    bool wasFollowerLocked = false;
+
+    int64 samplePosition = 0;
+
+    double currentSampleRate = 44100.0;
+
+    std::atomic<bool> stopped { true };
+    std::atomic<bool> wasPlaying { false };
+
+    ControlCommandQueue controlQueue;
+    std::atomic<bool> changePending { false };
+    static constexpr int changePollMilliseconds = 20;
+
+    // message thread
+    int idleTimeoutMinutes = 0;
+
+    static constexpr int sessionSettingsMagic = 0x53505041; // "APPS"
+    static constexpr size_t sessionSettingsSize = 8;
+
+    std::atomic<int64> barCount { 0 };
+    std::atomic<double> barPosition { 0.0 };
+
+    LatencyCalibrator latencyCalibrator;
+    CallbackMonitor callbackMonitor;
+    std::atomic<int> outputLatencySamples { 0 };
+
+    std::array<std::atomic<double>, 16> beatTimes {};
+    std::atomic<int64> beatCount { 0 };
 };
@@ -0,0 +1,255 @@
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "ChronometroEngine.h"
+#include "Music.h"
+#include "SoundStall.h"
+
+namespace chronometro
+{
+    // Timers, parameter notifications and the grooves the sound stall recompiles need a JUCE
+    // message thread. An embedding application has none, so the engines share one of their own; on
+    // macOS JUCE posts to the main run loop that every Cocoa application already runs.
+    class EngineMessageThread : private Thread
+    {
+    public:
+        EngineMessageThread() : Thread("Chronometro Messages")
+        {
+#if JUCE_MAC
+            initialiseJuce_GUI();
+#else
+            startThread(1);
+            initialised.wait(10000);
+#endif
+        }
+
+        ~EngineMessageThread() override
+        {
+#if JUCE_MAC
+            shutdownJuce_GUI();
+#else
+            MessageManager::getInstance()->stopDispatchLoop();
+            stopThread(10000);
+#endif
+        }
+
+    private:
+        void run() override
+        {
+            MessageManager::getInstance()->setCurrentThreadAsMessageThread();
+            initialiseJuce_GUI();
+            initialised.signal();
+
+            MessageManager::getInstance()->runDispatchLoop();
+
+            shutdownJuce_GUI();
+        }
+
+        WaitableEvent initialised;
+    };
+
+    struct Engine::Impl
+    {
+        Impl() : soundStallProcessor(metre) {}
+
+        template <typename Function>
+        static void callOnMessageThread(Function function)
+        {
+            auto* messageManager = MessageManager::getInstance();
+
+            if (messageManager->isThisTheMessageThread())
+                function();
+            else
+                messageManager->callFunctionOnMessageThread([](void* data) -> void* { (*static_cast<Function*>(data))(); return nullptr; }, &function);
+        }
+
+        // render thread
+        void render(float** out, int numChannels, int numFrames)
+        {
+            numEvents = 0;
+
+            if (!playing)
+            {
+                for (auto channel = 0; channel < numChannels; ++channel)
+                    FloatVectorOperations::clear(out[channel], numFrames);
+
+                if (wasPlaying)
+                {
+                    soundStallProcessor.reset();
+                    wasPlaying = false;
+                }
+
+                return;
+            }
+
+            if (!wasPlaying)
+            {
+                metre.update();
+                wasPlaying = true;
+            }
+
+            // the sound stall is stereo, so render in blocks of the prepared size and fan out to the caller's channels
+            for (auto start = 0; start < numFrames;)
+            {
+                auto numSamples = jmin(numFrames - start, renderBuffer.getNumSamples());
+                AudioSampleBuffer block { renderBuffer.getArrayOfWritePointers(), 2, numSamples };
+
+                block.clear();
+                midiBuffer.clear();
+                soundStallProcessor.processBlock(block, midiBuffer);
+
+                for (auto channel = 0; channel < numChannels; ++channel)
+                    FloatVectorOperations::copy(out[channel] + start, block.getReadPointer(jmin(channel, 1)), numSamples);
+
+                auto* metreEvents = metre.getEvents();
+
+                for (auto i = 0; i < metre.getNumEvents() && numEvents < (int) events.size(); ++i)
+                {
+                    auto& event = metreEvents[i];
+                    events[(size_t) numEvents++] = { start + event.samplePosition, event.beat, event.step, event.isBeatStart, event.hit, event.accent };
+                }
+
+                start += numSamples;
+            }
+
+            position = metre.getPosition();
+        }
+
+        void setParameter(const String& parameterID, float value)
+        {
+            if (auto* parameter = soundStallProcessor.getValueTreeState().getParameter(parameterID))
+                parameter->setValueNotifyingHost(parameter->convertTo0to1(value));
+        }
+
+        SharedResourcePointer<EngineMessageThread> messageThread;
+
+        Music::Metre metre;
+        SoundStallProcessor soundStallProcessor;
+
+        AudioSampleBuffer renderBuffer;
+        MidiBuffer midiBuffer;
+
+        std::array<Event, Music::Metre::maxEventsPerBlock> events;
+        int numEvents = 0;
+
+        std::atomic<bool> playing { false };
+        bool wasPlaying = false;
+
+        // prepare waits out a render in progress and keeps the next ones silent until it is done
+        std::atomic<bool> preparing { false }, rendering { false };
+        std::atomic<double> position { 0.0 };
+    };
+
+    Engine::Engine(double sampleRate, int maximumFramesPerRender) : impl(new Impl())
+    {
+        prepare(sampleRate, maximumFramesPerRender);
+    }
+
+    Engine::~Engine()
+    {
+        // the last engine stops the message thread, which it cannot do from the thread itself
+        SharedResourcePointer<EngineMessageThread> messageThread;
+
+        Impl::callOnMessageThread([this] { impl.reset(); });
+    }
+
+    void Engine::prepare(double sampleRate, int maximumFramesPerRender)
+    {
+        impl->preparing = true;
+
+        while (impl->rendering)
+            Thread::yield();
+
+        Impl::callOnMessageThread([this, sampleRate, maximumFramesPerRender] {
+            impl->metre.prepareToPlay(sampleRate);
+            impl->soundStallProcessor.prepareToPlay(sampleRate, maximumFramesPerRender);
+            impl->renderBuffer.setSize(2, maximumFramesPerRender);
+        });
+
+        impl->preparing = false;
+    }
+
+    bool Engine::setPattern(const std::vector<Beat>& beats, bool atNextBar)
+    {
+        if (beats.empty() || (int) beats.size() > Music::Pattern::maxBeats)
+            return false;
+
+        // the metre's base note value belongs to the message thread, so the beats are checked there
+        auto isValid = false;
+
+        Impl::callOnMessageThread([this, &beats, atNextBar, &isValid] {
+            auto baseNoteValue = (int) impl->metre.baseNoteValue;
+            std::vector<Music::Pattern::BeatCells> beatCells;
+
+            for (auto& beat : beats)
+            {
+                auto noteValue = static_cast<Music::NoteValue>(beat.noteValue);
+
+                // a beat has one pulse per note of its value that fits into the base note
+                if (!Music::Pattern::isValidNoteValue(noteValue) || (int) noteValue % baseNoteValue != 0
+                    || (int) beat.pulses.size() != (int) noteValue / baseNoteValue || (int) beat.pulses.size() > Music::Pattern::maxPulses)
+                    return;
+
+                Music::Pattern::BeatCells cells { noteValue, {} };
+
+                for (auto& pulse : beat.pulses)
+                    cells.cells.push_back({ pulse.hit, jlimit(0.0f, 1.0f, pulse.accent) });
+
+                beatCells.push_back(std::move(cells));
+            }
+
+            impl->metre.setPattern(new Music::Pattern({}, std::move(beatCells), impl->metre.baseNoteValue), atNextBar);
+            isValid = true;
+        });
+
+        return isValid;
+    }
+
+    int Engine::getNumPresets() const
+    {
+        return impl->metre.presetBank.size();
+    }
+
+    bool Engine::recallPreset(int presetIndex)
+    {
+        if (!isPositiveAndBelow(presetIndex, getNumPresets()))
+            return false;
+
+        Impl::callOnMessageThread([this, presetIndex] { impl->metre.recallPreset(presetIndex); });
+        return true;
+    }
+
+    void Engine::setTempo(float bpm) { impl->setParameter("tempo", bpm); }
+    float Engine::getTempo() const { return impl->metre.getBPM(); }
+
+    void Engine::setGain(float decibels) { impl->setParameter("gain", decibels); }
+    void Engine::setAccentDepth(float depth) { impl->setParameter("accent", depth); }
+    void Engine::setSound(Sound sound) { impl->setParameter("Slot 1", (float) sound); }
+
+    void Engine::start() { impl->playing = true; }
+    void Engine::stop() { impl->playing = false; }
+    bool Engine::isPlaying() const { return impl->playing; }
+
+    void Engine::render(float** out, int numChannels, int numFrames)
+    {
+        auto& engine = *impl;
+        engine.rendering = true;
+
+        if (engine.preparing)
+        {
+            engine.numEvents = 0;
+
+            for (auto channel = 0; channel < numChannels; ++channel)
+                FloatVectorOperations::clear(out[channel], numFrames);
+        }
+        else
+        {
+            engine.render(out, numChannels, numFrames);
+        }
+
+        engine.rendering = false;
+    }
+
+    const Event* Engine::getEvents() const { return impl->events.data(); }
+    int Engine::getNumEvents() const { return impl->numEvents; }
+
+    double Engine::getPosition() const { return impl->position; }
+}
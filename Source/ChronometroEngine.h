@@ -0,0 +1,124 @@
+#pragma once
+
+// The metronome engine for embedding in other applications. This header has no JUCE types, so it
+// can be used without the JUCE headers; the engine itself runs JUCE behind it.
+
+#include <memory>
+#include <vector>
+
+#define CHRONOMETRO_ENGINE_API_VERSION 1
+
+#if defined(CHRONOMETRO_ENGINE_SHARED)
+ #if defined(_WIN32)
+  #if defined(CHRONOMETRO_ENGINE_EXPORTS)
+   #define CHRONOMETRO_ENGINE_API __declspec(dllexport)
+  #else
+   #define CHRONOMETRO_ENGINE_API __declspec(dllimport)
+  #endif
+ #else
+  #define CHRONOMETRO_ENGINE_API __attribute__((visibility("default")))
+ #endif
+#else
+ #define CHRONOMETRO_ENGINE_API
+#endif
+
+namespace chronometro
+{
+    enum class NoteValue
+    {
+        whole = 1,
+        half = 2,
+        quarter = 4,
+        eighth = 8,
+        triplet = 12,
+        sixteenth = 16
+    };
+
+    enum class Sound
+    {
+        sine,
+        block,
+        fire,
+        voice
+    };
+
+    struct Pulse
+    {
+        bool hit = true;
+        float accent = 0.0f; // 0 to 1
+    };
+
+    // the pulses of a beat are all of its note value; a quarter beat of eighths has two
+    struct Beat
+    {
+        NoteValue noteValue = NoteValue::quarter;
+        std::vector<Pulse> pulses;
+    };
+
+    // a pulse onset within the frames of the last render call
+    struct Event
+    {
+        int frame;
+        int beat;
+        int step;
+        bool isBeatStart;
+        bool hit;
+        float accent;
+    };
+
+    // every engine keeps its own tempo, sample rate and pattern, so any number can run side by side
+    class CHRONOMETRO_ENGINE_API Engine
+    {
+    public:
+        Engine(double sampleRate, int maximumFramesPerRender);
+        ~Engine();
+
+        Engine(const Engine&) = delete;
+        Engine& operator=(const Engine&) = delete;
+
+        //==============================================================================
+        // control thread; none of these block the render thread
+
+        // renders that overlap it come out silent, and it waits for a render in progress to finish
+        void prepare(double sampleRate, int maximumFramesPerRender);
+
+        // returns false if the beats are empty or out of range, or if a beat's note value is not a
+        // multiple of the metre's base note value with one pulse per base note in it, e.g. two
+        // pulses for an eighth in 4/4; the pattern is picked up at the next beat, or at the next bar
+        // if asked to
+        bool setPattern(const std::vector<Beat>& beats, bool atNextBar = false);
+
+        int getNumPresets() const;
+        bool recallPreset(int presetIndex);
+
+        void setTempo(float bpm);
+        float getTempo() const;
+
+        void setGain(float decibels);
+        void setAccentDepth(float depth);
+        void setSound(Sound sound);
+
+        void start();
+        void stop();
+        bool isPlaying() const;
+
+        //==============================================================================
+        // render thread
+
+        // writes numFrames of every channel; mono and more than two channels are fine
+        void render(float** out, int numChannels, int numFrames);
+
+        const Event* getEvents() const;
+        int getNumEvents() const;
+
+        //==============================================================================
+        // any thread
+
+        // beats from the start of the bar, as of the end of the last render call that played
+        double getPosition() const;
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> impl;
+    };
+}
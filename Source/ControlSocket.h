@@ -0,0 +1,370 @@
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "Chronometro.h"
+
+#if !JUCE_WINDOWS
+ #include <cerrno>
+ #include <poll.h>
+ #include <sys/socket.h>
+ #include <sys/stat.h>
+ #include <sys/un.h>
+ #include <unistd.h>
+#endif
+
+// Lets scripts drive the engine through a local socket (a named pipe on Windows). Every line is a
+// batch of commands separated by ';', answered with one line:
+//
+//     tempo <bpm>           the tempo in beats of the base note, as the tempo parameter counts
+//                           them, from the next audio block
+//     preset <n>            recall preset n (from 1) at the next bar, or with a start of the batch
+//     start [beat]          start, or jump while playing, at a beat of the bar (default 0)
+//     stop
+//     position              answers "position <bar> <beat> <bpm> <playing>"
+//     trace start|stop      record a trace of all threads (see TraceRecorder)
+//     trace dump [file]     write the recorded trace as Chrome JSON, answers "trace <file>"
+//
+// The text is decoded on this thread; the audio thread only pops the commands of a batch from a
+// lock-free queue at the start of its next block, so they all take effect together.
+class ControlSocket : private Thread
+{
+public:
+    ControlSocket(BeatAudioSource& source, Music::Metre& metre, const String& path = getDefaultPath())
+        : Thread("Control Socket"), beatAudioSource(source), musicMetre(metre), socketPath(path)
+    {
+        startThread(8);
+    }
+
+    ~ControlSocket() override
+    {
+        signalThreadShouldExit();
+#if JUCE_WINDOWS
+        pipe.close();
+#endif
+        stopThread(2000);
+    }
+
+    static String getDefaultPath()
+    {
+#if JUCE_WINDOWS
+        return ProjectInfo::projectName;
+#else
+        return File::getSpecialLocation(File::tempDirectory).getChildFile(String(ProjectInfo::projectName) + ".control").getFullPathName();
+#endif
+    }
+
+private:
+    String handleLine(const String& line)
+    {
+        TraceRecorder::setThreadName("Control Socket");
+
+        std::vector<ControlCommand> batch;
+        String reply = "ok";
+        float tempo = 0.0f;
+        int presetIndex = -1;
+
+        for (auto command : StringArray::fromTokens(line, ";", "\""))
+        {
+            auto tokens = StringArray::fromTokens(command.trim(), true);
+            auto name = tokens[0].toLowerCase();
+
+            if (name.isEmpty())
+                continue;
+
+            if (name == "tempo" && tokens.size() == 2)
+            {
+                if (!isNumber(tokens[1]))
+                    return "error bad tempo " + tokens[1].quoted();
+
+                tempo = jlimit(20.0f, 999.0f, tokens[1].getFloatValue());
+                batch.push_back({ ControlCommand::Type::tempo, tempo });
+            }
+            else if (name == "preset" && tokens.size() == 2)
+            {
+                if (!tokens[1].containsOnly("0123456789") || tokens[1].isEmpty())
+                    return "error no preset " + tokens[1];
+
+                presetIndex = tokens[1].getIntValue() - 1;
+            }
+            else if (name == "start" && tokens.size() <= 2)
+            {
+                if (tokens.size() == 2 && !isNumber(tokens[1]))
+                    return "error bad beat " + tokens[1].quoted();
+
+                batch.push_back({ ControlCommand::Type::start, tokens[1].getDoubleValue() });
+            }
+            else if (name == "stop" && tokens.size() == 1)
+            {
+                batch.push_back({ ControlCommand::Type::stop, 0.0 });
+            }
+            else if (name == "position" && tokens.size() == 1)
+            {
+                auto status = beatAudioSource.getTransportStatus();
+                reply = "position " + String(status.bar) + " " + String(status.beat, 3) + " "
+                      + String(musicMetre.getBPM(), 2) + " " + String((int) status.playing);
+            }
+            else if (name == "trace" && (tokens[1] == "start" || tokens[1] == "stop") && tokens.size() == 2)
+            {
+                if (tokens[1] == "start")
+                    TraceRecorder::start();
+                else
+                    TraceRecorder::stop();
+            }
+            else if (name == "trace" && tokens[1] == "dump" && tokens.size() <= 3)
+            {
+                auto file = tokens.size() == 3 ? File::getCurrentWorkingDirectory().getChildFile(tokens[2].unquoted())
+                                               : TraceRecorder::getDefaultTraceFile();
+
+                if (!TraceRecorder::writeTrace(file))
+                    return "error cannot write " + file.getFullPathName();
+
+                reply = "trace " + file.getFullPathName();
+            }
+            else
+            {
+                return "error unknown command " + command.trim().quoted();
+            }
+        }
+
+        // the preset is pending before the batch is queued, so a start in it plays the preset
+        // from its first block
+        if (presetIndex >= 0)
+        {
+            auto result = recallPreset(presetIndex);
+
+            if (result.isNotEmpty())
+                return result;
+        }
+
+        if (!beatAudioSource.pushControlCommands(batch.data(), (int) batch.size()))
+            return "error the queue is full";
+
+        // the parameter follows on the message thread, so the UI and the session agree
+        if (tempo > 0.0f)
+            MessageManager::callAsync([&source = beatAudioSource, tempo] {
+                auto* tempoParameter = source.getValueTreeState().getParameter("tempo");
+                tempoParameter->setValueNotifyingHost(tempoParameter->convertTo0to1(tempo));
+            });
+
+        return reply;
+    }
+
+    static bool isNumber(const String& token)
+    {
+        return token.containsOnly("0123456789.-") && token.containsAnyOf("0123456789");
+    }
+
+    // the preset bank and the recall belong to the message thread; a modal loop may hold it up,
+    // so this gives up after a while, and whichever side claims the request first decides it
+    String recallPreset(int presetIndex)
+    {
+        struct Request
+        {
+            WaitableEvent done;
+            std::atomic<bool> claimed { false };
+            bool exists = false;
+        };
+
+        auto request = std::make_shared<Request>();
+
+        MessageManager::callAsync([request, &metre = musicMetre, presetIndex] {
+            if (request->claimed.exchange(true))
+                return;
+
+            request->exists = isPositiveAndBelow(presetIndex, metre.presetBank.size());
+
+            if (request->exists)
+                metre.recallPreset(presetIndex);
+
+            request->done.signal();
+        });
+
+        if (!request->done.wait(recallTimeoutMilliseconds) && !request->claimed.exchange(true))
+            return "error the message thread is busy";
+
+        request->done.wait();
+        return request->exists ? String() : "error no preset " + String(presetIndex + 1);
+    }
+
+#if JUCE_WINDOWS
+    void run() override
+    {
+        while (!threadShouldExit())
+        {
+            if (!pipe.isOpen() && !pipe.createNewPipe(socketPath, true))
+            {
+                Logger::writeToLog("Cannot create the control pipe " + socketPath);
+                return;
+            }
+
+            char buffer[512];
+            auto numRead = pipe.read(buffer, (int) sizeof(buffer), 250);
+
+            if (numRead < 0)
+            {
+                pipe.close();
+                continue;
+            }
+
+            for (auto& line : receiveLines(pendingInput, buffer, numRead))
+            {
+                auto reply = handleLine(line) + "\n";
+                pipe.write(reply.toRawUTF8(), (int) reply.getNumBytesAsUTF8(), 250);
+            }
+        }
+    }
+
+    NamedPipe pipe;
+    String pendingInput;
+#else
+    void run() override
+    {
+        auto listener = openListener();
+
+        if (listener < 0)
+            return;
+
+        std::vector<pollfd> descriptors { { listener, POLLIN, 0 } };
+        std::map<int, String> pendingInput;
+
+        while (!threadShouldExit())
+        {
+            if (::poll(descriptors.data(), (nfds_t) descriptors.size(), 250) <= 0)
+                continue;
+
+            if ((descriptors[0].revents & POLLIN) != 0)
+            {
+                auto client = ::accept(listener, nullptr, nullptr);
+
+                if (client >= 0)
+                {
+                    // a client that stops reading its replies is dropped rather than waited for
+                    timeval timeout { 0, 250000 };
+                    ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+                    int noSignal = 1;
+                    ::setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &noSignal, sizeof(noSignal));
+#endif
+                    descriptors.push_back({ client, POLLIN, 0 });
+                }
+            }
+
+            for (auto it = descriptors.begin() + 1; it != descriptors.end();)
+            {
+                if (it->revents == 0)
+                {
+                    ++it;
+                    continue;
+                }
+
+                char buffer[512];
+                auto numRead = (int) ::read(it->fd, buffer, sizeof(buffer));
+                auto isConnected = numRead > 0;
+
+                if (isConnected)
+                    for (auto& line : receiveLines(pendingInput[it->fd], buffer, numRead))
+                        if (!(isConnected = writeReply(it->fd, handleLine(line) + "\n")))
+                            break;
+
+                if (!isConnected)
+                {
+                    ::close(it->fd);
+                    pendingInput.erase(it->fd);
+                    it = descriptors.erase(it);
+                    continue;
+                }
+
+                ++it;
+            }
+        }
+
+        for (auto& descriptor : descriptors)
+            ::close(descriptor.fd);
+
+        ::unlink(socketPath.toRawUTF8());
+    }
+
+    // false once the client has gone (EPIPE) or has not taken the reply within the send timeout
+    static bool writeReply(int client, const String& reply)
+    {
+#ifdef MSG_NOSIGNAL
+        const int flags = MSG_NOSIGNAL;
+#else
+        const int flags = 0;
+#endif
+        auto* data = reply.toRawUTF8();
+        auto numRemaining = reply.getNumBytesAsUTF8();
+
+        while (numRemaining > 0)
+        {
+            auto numWritten = ::send(client, data, numRemaining, flags);
+
+            if (numWritten < 0 && errno == EINTR)
+                continue;
+
+            if (numWritten <= 0)
+                return false;
+
+            data += numWritten;
+            numRemaining -= (size_t) numWritten;
+        }
+
+        return true;
+    }
+
+    int openListener()
+    {
+        sockaddr_un address {};
+        address.sun_family = AF_UNIX;
+        socketPath.copyToUTF8(address.sun_path, sizeof(address.sun_path));
+
+        auto listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+        // a socket file that nobody answers on was left behind by an instance that crashed
+        if (::connect(listener, (sockaddr*) &address, sizeof(address)) == 0)
+        {
+            Logger::writeToLog("Another instance already listens on " + socketPath);
+            ::close(listener);
+            return -1;
+        }
+
+        ::close(listener);
+        ::unlink(socketPath.toRawUTF8());
+
+        listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (::bind(listener, (sockaddr*) &address, sizeof(address)) != 0 || ::listen(listener, 4) != 0)
+        {
+            Logger::writeToLog("Cannot listen on " + socketPath);
+            ::close(listener);
+            return -1;
+        }
+
+        ::chmod(socketPath.toRawUTF8(), S_IRUSR | S_IWUSR);
+        return listener;
+    }
+#endif
+
+    static StringArray receiveLines(String& pending, const char* data, int numBytes)
+    {
+        pending += String::fromUTF8(data, numBytes);
+
+        StringArray lines;
+
+        while (pending.containsChar('\n'))
+        {
+            lines.add(pending.upToFirstOccurrenceOf("\n", false, false).trimEnd());
+            pending = pending.fromFirstOccurrenceOf("\n", false, false);
+        }
+
+        return lines;
+    }
+
+    static constexpr int recallTimeoutMilliseconds = 1000;
+
+    BeatAudioSource& beatAudioSource;
+    Music::Metre& musicMetre;
+    const String socketPath;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ControlSocket)
+};
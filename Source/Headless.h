@@ -0,0 +1,197 @@
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "Chronometro.h"
+#include "ControlSocket.h"
+#include "IdleTimeout.h"
+
+// Runs the audio engine alone, without a window, a component tree or an OpenGL context, e.g. on a
+// click box without a display. It is driven by a "key = value" file that is re-read when it changes:
+//
+//     device = <audio output device>    sampleRate = 48000    bufferSize = 128
+//     tempo = 120                       preset = 2            playing = true
+//     midiOutput = off | virtual | <MIDI output device>
+//     idleTimeout = 5                   minutes stopped before the device is closed, 0 keeps it open
+//
+// Any other key that names a parameter of the sound processor (gain, accent, ...) sets it. The
+// ControlSocket takes commands at run time as well.
+class HeadlessEngine : private Timer
+{
+public:
+    explicit HeadlessEngine(const File& configFileToUse)
+        : configFile(configFileToUse), beatAudioSource(musicMetre)
+    {
+        beatAudioSource.loadSession();
+
+        audioSourcePlayer.setSource(&beatAudioSource);
+        deviceManager.addAudioCallback(&audioSourcePlayer);
+
+        if (!configFile.existsAsFile())
+            Logger::writeToLog("No configuration at " + configFile.getFullPathName() + ", using the defaults");
+
+        applyConfig();
+        startTimer(1000);
+    }
+
+    ~HeadlessEngine() override
+    {
+        stopTimer();
+
+        deviceManager.removeAudioCallback(&audioSourcePlayer);
+        audioSourcePlayer.setSource(nullptr);
+        deviceManager.closeAudioDevice();
+
+        beatAudioSource.saveSession();
+    }
+
+    static File getDefaultConfigFile()
+    {
+        return File::getSpecialLocation(File::userApplicationDataDirectory)
+            .getChildFile(ProjectInfo::projectName)
+            .getChildFile("Headless.conf");
+    }
+
+private:
+    void timerCallback() override
+    {
+        if (configFile.getLastModificationTime() != configModificationTime)
+            applyConfig();
+    }
+
+    static StringPairArray readConfig(const File& file)
+    {
+        StringPairArray config;
+
+        for (auto line : StringArray::fromLines(file.loadFileAsString()))
+        {
+            line = line.upToFirstOccurrenceOf("#", false, false).trim();
+
+            if (line.containsChar('='))
+                config.set(line.upToFirstOccurrenceOf("=", false, false).trim(),
+                           line.fromFirstOccurrenceOf("=", false, false).trim().unquoted());
+        }
+
+        return config;
+    }
+
+    void applyConfig()
+    {
+        configModificationTime = configFile.getLastModificationTime();
+        auto config = readConfig(configFile);
+
+        openAudioDevice(config);
+
+        if (config["midiOutput"] != midiOutputName)
+        {
+            midiOutputName = config["midiOutput"];
+            beatAudioSource.setMidiOutput(openMidiOutput(midiOutputName));
+        }
+
+        auto& valueTreeState = beatAudioSource.getValueTreeState();
+
+        for (auto& key : config.getAllKeys())
+        {
+            if (auto* parameter = valueTreeState.getParameter(key))
+                parameter->setValueNotifyingHost(parameter->convertTo0to1(config[key].getFloatValue()));
+        }
+
+        // numbered from 1 like the keys of the app; only a new number is recalled
+        auto presetIndex = config["preset"].getIntValue() - 1;
+
+        if (presetIndex >= 0 && presetIndex != currentPreset)
+        {
+            currentPreset = presetIndex;
+            musicMetre.recallPreset(presetIndex);
+        }
+
+        // applied after the preset, which brings its own
+        if (config.containsKey("metre") && config["metre"] != metreSetting)
+        {
+            metreSetting = config["metre"];
+            musicMetre.setTimeSignature(metreSetting);
+        }
+
+        // kept with the session as in the app, so only a change of the setting replaces it
+        if (config.containsKey("idleTimeout") && config["idleTimeout"] != idleTimeoutSetting)
+        {
+            idleTimeoutSetting = config["idleTimeout"];
+            beatAudioSource.setIdleTimeoutMinutes(idleTimeoutSetting.getIntValue());
+        }
+
+        // likewise only a change of the setting moves the transport, which the socket may also have moved
+        if (config["playing"] != playingSetting)
+        {
+            playingSetting = config["playing"];
+
+            if (playingSetting.getIntValue() != 0 || playingSetting.equalsIgnoreCase("true"))
+                beatAudioSource.start();
+            else
+                beatAudioSource.stop();
+        }
+    }
+
+    void openAudioDevice(const StringPairArray& config)
+    {
+        auto deviceName = config["device"];
+        auto sampleRate = config["sampleRate"].getDoubleValue();
+        auto bufferSize = config["bufferSize"].getIntValue();
+
+        String error;
+
+        if (deviceManager.getCurrentAudioDevice() == nullptr)
+            error = deviceManager.initialise(0, 2, nullptr, true, deviceName, nullptr);
+
+        auto setup = deviceManager.getAudioDeviceSetup();
+        auto newSetup = setup;
+
+        if (deviceName.isNotEmpty())
+            newSetup.outputDeviceName = deviceName;
+
+        if (sampleRate > 0.0)
+            newSetup.sampleRate = sampleRate;
+
+        if (bufferSize > 0)
+            newSetup.bufferSize = bufferSize;
+
+        if (error.isEmpty() && newSetup != setup)
+            error = deviceManager.setAudioDeviceSetup(newSetup, true);
+
+        if (error.isNotEmpty())
+            Logger::writeToLog("Cannot open the audio device: " + error);
+    }
+
+    static std::unique_ptr<MidiOutput> openMidiOutput(const String& name)
+    {
+        if (name.isEmpty() || name.equalsIgnoreCase("off"))
+            return {};
+
+#if !JUCE_WINDOWS
+        if (name.equalsIgnoreCase("virtual"))
+            return MidiOutput::createNewDevice(ProjectInfo::projectName);
+#endif
+
+        for (auto& device : MidiOutput::getAvailableDevices())
+            if (device.name == name)
+                return MidiOutput::openDevice(device.identifier);
+
+        Logger::writeToLog("No MIDI output named " + name);
+        return {};
+    }
+
+    const File configFile;
+    Time configModificationTime;
+
+    Music::Metre musicMetre;
+    BeatAudioSource beatAudioSource;
+
+    AudioDeviceManager deviceManager;
+    AudioSourcePlayer audioSourcePlayer;
+    AudioDeviceIdleTimeout idleTimeout { deviceManager, beatAudioSource };
+
+    ControlSocket controlSocket { beatAudioSource, musicMetre };
+
+    String midiOutputName, playingSetting { "unset" }, metreSetting, idleTimeoutSetting;
+    int currentPreset = -1;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(HeadlessEngine)
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "Chronometro.h"
+
+// Closes the audio device once the transport has been stopped for the minutes the session keeps,
+// so an idle app or click box lets the system sleep, and opens it again as soon as a command waits
+// for it, e.g. a start from the control socket. The app and the headless engine share it.
+class AudioDeviceIdleTimeout : private Timer
+{
+public:
+    AudioDeviceIdleTimeout(AudioDeviceManager& manager, BeatAudioSource& source)
+        : deviceManager(manager), beatAudioSource(source)
+    {
+        startTimer(1000);
+    }
+
+    ~AudioDeviceIdleTimeout() override
+    {
+        stopTimer();
+    }
+
+    bool isSuspended() const { return suspended; }
+
+    void resume()
+    {
+        if (!suspended)
+            return;
+
+        suspended = false;
+        idleSince = 0.0;
+
+        deviceManager.restartLastAudioDevice();
+        startTimer(1000);
+    }
+
+private:
+    void timerCallback() override
+    {
+        // a start from the control socket waits in the queue of the closed device, and a new
+        // device setup opens one without asking
+        if (suspended)
+        {
+            if (beatAudioSource.hasPendingCommands() || deviceManager.getCurrentAudioDevice() != nullptr)
+                resume();
+
+            return;
+        }
+
+        auto timeoutMinutes = beatAudioSource.getIdleTimeoutMinutes();
+
+        // a latency measurement needs the device while stopped
+        if (timeoutMinutes <= 0 || !beatAudioSource.isIdle() || beatAudioSource.getLatencyCalibrator().isRunning()
+            || deviceManager.getCurrentAudioDevice() == nullptr)
+        {
+            idleSince = 0.0;
+            return;
+        }
+
+        auto now = Time::getMillisecondCounterHiRes();
+
+        if (idleSince == 0.0)
+            idleSince = now;
+
+        if (now - idleSince >= 60000.0 * timeoutMinutes)
+        {
+            deviceManager.closeAudioDevice();
+            suspended = true;
+
+            // polled more often while closed, so a command is not kept waiting
+            startTimer(200);
+        }
+    }
+
+    AudioDeviceManager& deviceManager;
+    BeatAudioSource& beatAudioSource;
+
+    double idleSince = 0.0;
+    bool suspended = false;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(AudioDeviceIdleTimeout)
+};
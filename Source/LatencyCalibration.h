@@ -0,0 +1,165 @@
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+// Measures the round trip of the audio device with a loopback cable from an output to an input:
+// a few test clicks go out, and the delay until each comes back in is the latency of the driver,
+// the buffers and the converters together.
+class LatencyCalibrator
+{
+public:
+    // message thread
+    void start()
+    {
+        roundTripSamples = -1;
+        requested = true;
+    }
+
+    bool isRunning() const { return requested || running; }
+
+    // the median of the clicks that came back, or -1 if too few did
+    int getRoundTripSamples() const { return roundTripSamples; }
+
+    // audio thread; reads the input that is still in the buffer and replaces it with the clicks,
+    // returns false if no calibration is running
+    bool process(const AudioSourceChannelInfo& bufferToFill, double sampleRate)
+    {
+        if (requested.exchange(false))
+            reset(sampleRate);
+
+        if (!running)
+            return false;
+
+        auto& buffer = *bufferToFill.buffer;
+
+        for (auto i = bufferToFill.startSample; i < bufferToFill.startSample + bufferToFill.numSamples; ++i, ++position)
+        {
+            auto input = 0.0f;
+
+            for (auto channel = 0; channel < buffer.getNumChannels(); ++channel)
+                input = jmax(input, std::abs(buffer.getSample(channel, i)));
+
+            auto output = 0.0f;
+
+            if (position < noiseSamples)
+            {
+                noiseFloor = jmax(noiseFloor, input);
+            }
+            else
+            {
+                auto clickIndex = (position - noiseSamples) / intervalSamples;
+                auto offset = (position - noiseSamples) % intervalSamples;
+
+                if (clickIndex >= numClicks)
+                {
+                    finish();
+                    buffer.clear(i, bufferToFill.startSample + bufferToFill.numSamples - i);
+                    break;
+                }
+
+                if (offset == 0)
+                    detected = false;
+
+                // a click that comes back later than the interval is taken for the next one's
+                if (!detected && offset > 0 && input > jmax(minimumThreshold, 4.0f * noiseFloor))
+                {
+                    measurements[(size_t) numMeasurements++] = (int) offset;
+                    detected = true;
+                }
+
+                if (offset < clickSamples)
+                    output = clickLevel * std::sin(MathConstants<float>::twoPi * clickFrequency * (float) offset / (float) sampleRate);
+            }
+
+            for (auto channel = 0; channel < buffer.getNumChannels(); ++channel)
+                buffer.setSample(channel, i, output);
+        }
+
+        return true;
+    }
+
+    //==============================================================================
+    // the results are kept per device, sample rate and buffer size, which all change the latency
+
+    static String getDeviceKey(AudioIODevice& device)
+    {
+        return device.getTypeName() + "/" + device.getName() + "/" + String(device.getCurrentSampleRate()) + "/" + String(device.getCurrentBufferSizeSamples());
+    }
+
+    static int loadRoundTrip(const String& deviceKey)
+    {
+        if (auto xml = parseXML(getSettingsFile()))
+            if (auto* device = xml->getChildByAttribute("key", deviceKey))
+                return device->getIntAttribute("roundTrip", -1);
+
+        return -1;
+    }
+
+    static void saveRoundTrip(const String& deviceKey, int samples)
+    {
+        auto xml = parseXML(getSettingsFile());
+
+        if (xml == nullptr)
+            xml = std::make_unique<XmlElement>("LATENCY");
+
+        auto* device = xml->getChildByAttribute("key", deviceKey);
+
+        if (device == nullptr)
+        {
+            device = xml->createNewChildElement("DEVICE");
+            device->setAttribute("key", deviceKey);
+        }
+
+        device->setAttribute("roundTrip", samples);
+
+        getSettingsFile().getParentDirectory().createDirectory();
+        xml->writeTo(getSettingsFile());
+    }
+
+private:
+    static File getSettingsFile()
+    {
+        return File::getSpecialLocation(File::userApplicationDataDirectory)
+            .getChildFile(ProjectInfo::projectName)
+            .getChildFile("Latency.xml");
+    }
+
+    void reset(double sampleRate)
+    {
+        noiseSamples = (int64) (0.25 * sampleRate);
+        intervalSamples = (int64) (0.5 * sampleRate);
+        clickSamples = (int64) (0.001 * sampleRate) + 1;
+
+        position = 0;
+        noiseFloor = 0.0f;
+        numMeasurements = 0;
+        detected = false;
+        running = true;
+    }
+
+    void finish()
+    {
+        running = false;
+
+        if (numMeasurements < numClicks / 2)
+            return;
+
+        std::sort(measurements.begin(), measurements.begin() + numMeasurements);
+        roundTripSamples = measurements[(size_t) numMeasurements / 2];
+    }
+
+    static constexpr int numClicks = 8;
+    static constexpr float clickLevel = 0.8f;
+    static constexpr float clickFrequency = 2000.0f;
+    static constexpr float minimumThreshold = 0.02f;
+
+    std::atomic<bool> requested { false }, running { false };
+    std::atomic<int> roundTripSamples { -1 };
+
+    int64 noiseSamples = 0, intervalSamples = 0, clickSamples = 0, position = 0;
+    float noiseFloor = 0.0f;
+    bool detected = false;
+
+    std::array<int, numClicks> measurements;
+    int numMeasurements = 0;
+};
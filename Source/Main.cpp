@@ -1,105 +1,146 @@
-/*
-  ==============================================================================
-
-    This file was auto-generated!
-
-    It contains the basic startup code for a JUCE application.
-
-  ==============================================================================
-*/
-
-#include "../JuceLibraryCode/JuceHeader.h"
-#include "MainComponent.h"
-
-//==============================================================================
-class BuildaMIDIsynthesiserApplication : public JUCEApplication
-{
-public:
-    //==============================================================================
-    BuildaMIDIsynthesiserApplication() {}
-
-    const String getApplicationName() override { return ProjectInfo::projectName; }
-    const String getApplicationVersion() override { return ProjectInfo::versionString; }
-    bool moreThanOneInstanceAllowed() override { return true; }
-
-    //==============================================================================
-    void initialise(const String& commandLine) override
-    {
-        // This method is where you should put your application's initialisation code..
-
-        mainWindow.reset(new MainWindow(getApplicationName()));
-    }
-
-    void shutdown() override
-    {
-        // Add your application's shutdown code here..
-
-        mainWindow = nullptr; // (deletes our window)
-    }
-
-    //==============================================================================
-    void systemRequestedQuit() override
-    {
-        // This is called when the app is being asked to quit: you can ignore this
-        // request and let the app carry on running, or call quit() to allow the app to close.
-        quit();
-    }
-
-    void anotherInstanceStarted(const String& commandLine) override
-    {
-        // When another instance of the app is launched while this one is running,
-        // this method is invoked, and the commandLine parameter tells you what
-        // the other instance's command-line arguments were.
-    }
-
-    //==============================================================================
-    /*
-        This class implements the desktop window that contains an instance of
-        our MainComponent class.
-    */
-    class MainWindow : public DocumentWindow
-    {
-    public:
-        MainWindow(String name) : DocumentWindow(name,
-                                                 Desktop::getInstance().getDefaultLookAndFeel().findColour(ResizableWindow::backgroundColourId),
-                                                 DocumentWindow::allButtons)
-        {
-            setUsingNativeTitleBar(true);
-            setContentOwned(new MainComponent(), true);
-
-#if JUCE_IOS || JUCE_ANDROID
-            setFullScreen(true);
-#else
-            setResizable(true, true);
-            centreWithSize(getWidth(), getHeight());
-#endif
-
-            setVisible(true);
-        }
-
-        void closeButtonPressed() override
-        {
-            // This is called when the user tries to close this window. Here, we'll just
-            // ask the app to quit when this happens, but you can change this to do
-            // whatever you need.
-            JUCEApplication::getInstance()->systemRequestedQuit();
-        }
-
-        /* Note: Be careful if you override any DocumentWindow methods - the base
-           class uses a lot of them, so by overriding you might break its functionality.
-           It's best to do all your work in your content component instead, but if
-           you really have to override any DocumentWindow methods, make sure your
-           subclass also calls the superclass's method.
-        */
-
-    private:
-        JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(MainWindow)
-    };
-
-private:
-    std::unique_ptr<MainWindow> mainWindow;
-};
-
-//==============================================================================
-// This macro generates the main() routine that launches the app.
-START_JUCE_APPLICATION(BuildaMIDIsynthesiserApplication)
+/*
+  ==============================================================================
+
+    This file was auto-generated!
+
+    It contains the basic startup code for a JUCE application.
+
+  ==============================================================================
+*/
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "Headless.h"
+#include "MainComponent.h"
+#include "MidiClockCheck.h"
+#include "RealtimeCheckSession.h"
+#include "TraceRecorder.h"
+
+//==============================================================================
+class BuildaMIDIsynthesiserApplication : public JUCEApplication
+{
+public:
+    //==============================================================================
+    BuildaMIDIsynthesiserApplication() {}
+
+    const String getApplicationName() override { return ProjectInfo::projectName; }
+    const String getApplicationVersion() override { return ProjectInfo::versionString; }
+    bool moreThanOneInstanceAllowed() override { return true; }
+
+    //==============================================================================
+    void initialise(const String& commandLine) override
+    {
+        // This method is where you should put your application's initialisation code..
+
+        // --headless [--config <file>] runs only the audio engine
+        auto arguments = StringArray::fromTokens(commandLine, true);
+
+        // --trace records from the start, for a trace dumped through the control socket
+        if (arguments.contains("--trace"))
+            TraceRecorder::start();
+
+        // --rt-check runs the scripted real-time self-test and exits with 1 on a violation
+        if (arguments.contains("--rt-check"))
+        {
+            realtimeCheckSession.reset(new RealtimeCheckSession());
+            return;
+        }
+
+        // --midi-check plays a few beats out through a virtual MIDI port and checks what comes back
+        if (arguments.contains("--midi-check"))
+        {
+            midiClockCheck.reset(new MidiClockCheck());
+            return;
+        }
+
+        if (arguments.contains("--headless"))
+        {
+            auto configIndex = arguments.indexOf("--config");
+            auto configFile = configIndex >= 0 ? File::getCurrentWorkingDirectory().getChildFile(arguments[configIndex + 1].unquoted())
+                                               : HeadlessEngine::getDefaultConfigFile();
+
+            headlessEngine.reset(new HeadlessEngine(configFile));
+            return;
+        }
+
+        mainWindow.reset(new MainWindow(getApplicationName()));
+    }
+
+    void shutdown() override
+    {
+        // Add your application's shutdown code here..
+
+        mainWindow = nullptr; // (deletes our window)
+        headlessEngine = nullptr;
+        realtimeCheckSession = nullptr;
+        midiClockCheck = nullptr;
+    }
+
+    //==============================================================================
+    void systemRequestedQuit() override
+    {
+        // This is called when the app is being asked to quit: you can ignore this
+        // request and let the app carry on running, or call quit() to allow the app to close.
+        quit();
+    }
+
+    void anotherInstanceStarted(const String& commandLine) override
+    {
+        // When another instance of the app is launched while this one is running,
+        // this method is invoked, and the commandLine parameter tells you what
+        // the other instance's command-line arguments were.
+    }
+
+    //==============================================================================
+    /*
+        This class implements the desktop window that contains an instance of
+        our MainComponent class.
+    */
+    class MainWindow : public DocumentWindow
+    {
+    public:
+        MainWindow(String name) : DocumentWindow(name,
+                                                 Desktop::getInstance().getDefaultLookAndFeel().findColour(ResizableWindow::backgroundColourId),
+                                                 DocumentWindow::allButtons)
+        {
+            setUsingNativeTitleBar(true);
+            setContentOwned(new MainComponent(), true);
+
+#if JUCE_IOS || JUCE_ANDROID
+            setFullScreen(true);
+#else
+            setResizable(true, true);
+            centreWithSize(getWidth(), getHeight());
+#endif
+
+            setVisible(true);
+        }
+
+        void closeButtonPressed() override
+        {
+            // This is called when the user tries to close this window. Here, we'll just
+            // ask the app to quit when this happens, but you can change this to do
+            // whatever you need.
+            JUCEApplication::getInstance()->systemRequestedQuit();
+        }
+
+        /* Note: Be careful if you override any DocumentWindow methods - the base
+           class uses a lot of them, so by overriding you might break its functionality.
+           It's best to do all your work in your content component instead, but if
+           you really have to override any DocumentWindow methods, make sure your
+           subclass also calls the superclass's method.
+        */
+
+    private:
+        JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(MainWindow)
+    };
+
+private:
+    std::unique_ptr<MainWindow> mainWindow;
+    std::unique_ptr<HeadlessEngine> headlessEngine;
+    std::unique_ptr<RealtimeCheckSession> realtimeCheckSession;
+    std::unique_ptr<MidiClockCheck> midiClockCheck;
+};
+
+//==============================================================================
+// This macro generates the main() routine that launches the app.
+START_JUCE_APPLICATION(BuildaMIDIsynthesiserApplication)
@@ -1,155 +1,360 @@
-/*
-  ==============================================================================
-
-    This file was auto-generated!
-
-  ==============================================================================
-*/
-
-#include "MainComponent.h"
-
-//==============================================================================
-MainComponent::MainComponent()
-    : beatAudioSource(musicMetre),
-      headerPanel(musicMetre),
-      bodyPanel(musicMetre)
-{
-    // Make sure you set the size of the component after
-    // you add any child components.
-    setLookAndFeel(&appLookAndFeel);
-
-    addAndMakeVisible(&headerPanel);
-    addAndMakeVisible(&bodyPanel);
-
-    bodyPanel.settingPanel.soundStallProcessorEditor.reset(beatAudioSource.createEditor());
-    bodyPanel.settingPanel.addAndMakeVisible(*bodyPanel.settingPanel.soundStallProcessorEditor);
-
-    beatAudioSource.addChangeListener(this);
-
-    openGLContext.attachTo(*getTopLevelComponent());
-
-    // setSize(640, 360);
-    setSize(360, 640);
-
-    // Some platforms require permissions to open input channels so request that here
-    if (RuntimePermissions::isRequired(RuntimePermissions::recordAudio)
-        && !RuntimePermissions::isGranted(RuntimePermissions::recordAudio))
-    {
-        RuntimePermissions::request(RuntimePermissions::recordAudio,
-                                    [&](bool granted) { if (granted)  setAudioChannels (2, 2); });
-    }
-    else
-    {
-        // Specify the number of input and output channels that we want to open
-        setAudioChannels(2, 2);
-    }
-}
-
-MainComponent::~MainComponent()
-{
-    // This shuts down the audio device and clears the audio source.
-    shutdownAudio();
-}
-
-//==============================================================================
-void MainComponent::prepareToPlay(int samplesPerBlockExpected, double sampleRate)
-{
-    // This function will be called when the audio device is started, or when
-    // its settings (i.e. sample rate, block size, etc) are changed.
-
-    // You can use this function to initialise any resources you might need,
-    // but be careful - it will be called on the audio thread, not the GUI thread.
-
-    // For more details, see the help for AudioProcessor::prepareToPlay()
-    beatAudioSource.prepareToPlay(samplesPerBlockExpected, sampleRate);
-    bodyPanel.metreListPanel.init(); // initialize after beatAudioSource get sampleRate
-}
-
-void MainComponent::getNextAudioBlock(const AudioSourceChannelInfo& bufferToFill)
-{
-    // Your audio-processing code goes here!
-
-    // For more details, see the help for AudioProcessor::getNextAudioBlock()
-
-    // Right now we are not producing any data, in which case we need to clear the buffer
-    // (to prevent the output of random noise)
-    // bufferToFill.clearActiveBufferRegion();
-    beatAudioSource.getNextAudioBlock(bufferToFill);
-
-    auto localTargetLevel = targetLevel;
-    bufferToFill.buffer->applyGainRamp(bufferToFill.startSample, bufferToFill.numSamples, currentLevel, localTargetLevel);
-    currentLevel = localTargetLevel;
-}
-
-void MainComponent::releaseResources()
-{
-    // This will be called when the audio device stops, or when it is being
-    // restarted due to a setting change.
-
-    // For more details, see the help for AudioProcessor::releaseResources()
-    beatAudioSource.releaseResources();
-}
-
-//==============================================================================
-void MainComponent::paint(Graphics& g)
-{
-    // (Our component is opaque, so we must completely fill the background with a solid colour)
-    g.fillAll(getLookAndFeel().findColour(ResizableWindow::backgroundColourId));
-
-    // You can add your drawing code here!
-}
-
-void MainComponent::resized()
-{
-    // This is called when the MainContentComponent is resized.
-    // If you add any child components, this is where you should
-    // update their positions.
-    auto isPortrait = getHeight() > getWidth();
-
-    FlexBox fbGroup;
-    FlexBox fbContainer;
-    float margin = 8.0f;
-
-    if (isPortrait)
-    {
-        auto width = getWidth() - 2.0f * margin;
-        auto height = getHeight() - 3.0f * margin;
-
-        fbGroup.flexDirection = FlexBox::Direction::column;
-
-        FlexItem header(width, 123.2f, headerPanel);
-        FlexItem body(width, height * 0.8f, bodyPanel);
-
-        FlexItem::Margin headerPanelMargin;
-        headerPanelMargin.bottom = margin;
-        fbGroup.items.addArray({ header.withMargin(headerPanelMargin), body });
-    }
-    else
-    {
-        auto width = getWidth() - 3.0f * margin;
-        auto height = getHeight() - 2.0f * margin;
-
-        fbGroup.flexDirection = FlexBox::Direction::row;
-
-        FlexItem header(width * 0.25f, height, headerPanel);
-        FlexItem body(width * 0.75f, height, bodyPanel);
-
-        FlexItem::Margin headerPanelMargin;
-        headerPanelMargin.right = margin;
-        fbGroup.items.addArray({ header.withMargin(headerPanelMargin), body });
-    }
-
-    fbContainer.items.add(FlexItem(fbGroup).withMargin({ margin }));
-    fbContainer.performLayout(getLocalBounds().toFloat());
-}
-
-void MainComponent::changeListenerCallback(ChangeBroadcaster* source)
-{
-    if (source == &beatAudioSource)
-    {
-        if (beatAudioSource.isPlaying())
-            changeState(Playing);
-        else
-            changeState(Stopped);
-    }
-}
+/*
+  ==============================================================================
+
+    This file was auto-generated!
+
+  ==============================================================================
+*/
+
+#include "MainComponent.h"
+
+//==============================================================================
+MainComponent::MainComponent()
+    : beatAudioSource(musicMetre),
+      headerPanel(musicMetre, beatAudioSource.getValueTreeState()),
+      bodyPanel(musicMetre)
+{
+    // Make sure you set the size of the component after
+    // you add any child components.
+    setLookAndFeel(&appLookAndFeel);
+
+    addAndMakeVisible(&headerPanel);
+    addAndMakeVisible(&bodyPanel);
+
+    // restore before the pattern view is built and before the audio device opens,
+    // so the first callback already plays the saved pattern
+    beatAudioSource.loadSession();
+    bodyPanel.metreListPanel.init();
+
+    bodyPanel.settingPanel.showIdleTimeoutMinutes(beatAudioSource.getIdleTimeoutMinutes());
+    bodyPanel.settingPanel.idleTimeoutBox.onChange = [this] {
+        beatAudioSource.setIdleTimeoutMinutes(bodyPanel.settingPanel.getIdleTimeoutMinutes());
+    };
+
+    bodyPanel.settingPanel.wrapDecibelSlider.attach(beatAudioSource.getValueTreeState());
+
+    bodyPanel.settingPanel.midiClockSyncButton.onClick = [this] {
+        midiClockFollower.setEnabled(bodyPanel.settingPanel.midiClockSyncButton.getToggleState());
+        updateClockSource();
+    };
+
+    sharedTransportFollower.onTempoChange = [this](float tempo) { headerPanel.setTempoParameter(tempo); };
+    sharedTransportFollower.onTransportChange = [this](bool shouldPlay) {
+        requestedTransport = shouldPlay ? TransportRequest::start : TransportRequest::stop;
+        handleAsyncUpdate();
+    };
+
+    bodyPanel.settingPanel.sharedTransportBox.onChange = [this] { updateClockSource(); };
+
+    bodyPanel.settingPanel.latencyCalibration.calibrateButton.onClick = [this] {
+        idleTimeout.resume();
+        calibratingLatency = true;
+        beatAudioSource.startLatencyCalibration();
+        bodyPanel.settingPanel.latencyCalibration.latencyLabel.setText("Measuring...", dontSendNotification);
+    };
+
+    headerPanel.visualBeatRegion.setBeatAudioSource(&beatAudioSource);
+    bodyPanel.settingPanel.callbackMonitorDisplay.setCallbackMonitor(&beatAudioSource.getCallbackMonitor());
+
+    bodyPanel.settingPanel.midiOutputSelector.onOutputChange = [this](std::unique_ptr<MidiOutput> midiOutput) {
+        beatAudioSource.setMidiOutput(std::move(midiOutput));
+    };
+#if JUCE_WINDOWS
+    bodyPanel.settingPanel.midiOutputSelector.midiOutputBox.setSelectedId(SettingPanel::MidiOutputSelector::offId);
+#else
+    bodyPanel.settingPanel.midiOutputSelector.midiOutputBox.setSelectedId(SettingPanel::MidiOutputSelector::virtualPortId);
+#endif
+    bodyPanel.settingPanel.audioDevicePanel.reset(new SettingPanel::AudioDevicePanel(deviceManager));
+    bodyPanel.settingPanel.addAndMakeVisible(*bodyPanel.settingPanel.audioDevicePanel);
+
+    bodyPanel.settingPanel.soundStallProcessorEditor.reset(beatAudioSource.createEditor());
+    bodyPanel.settingPanel.addAndMakeVisible(*bodyPanel.settingPanel.soundStallProcessorEditor);
+
+    beatAudioSource.addChangeListener(this);
+
+    // presets are recalled by MIDI program change, and the clock followed, from the chosen input only
+    bodyPanel.settingPanel.midiInputSelector.onInputChange = [this](const String& identifier) {
+        for (auto& device : MidiInput::getAvailableDevices())
+            deviceManager.setMidiInputDeviceEnabled(device.identifier, device.identifier == identifier);
+
+        SettingPanel::AudioDevicePanel::saveDeviceState(deviceManager);
+    };
+
+    deviceManager.addMidiInputDeviceCallback({}, this);
+    deviceManager.addChangeListener(this);
+
+    setWantsKeyboardFocus(true);
+
+    openGLContext.attachTo(*getTopLevelComponent());
+
+    // setSize(640, 360);
+    setSize(360, 640);
+
+    // the device chosen in the settings, if there is one
+    auto savedDeviceState = parseXML(SettingPanel::AudioDevicePanel::getDeviceStateFile());
+
+    // Some platforms require permissions to open input channels so request that here
+    if (RuntimePermissions::isRequired(RuntimePermissions::recordAudio)
+        && !RuntimePermissions::isGranted(RuntimePermissions::recordAudio))
+    {
+        // the callback is copied, so it shares the saved state rather than owning it
+        std::shared_ptr<XmlElement> deviceState = std::move(savedDeviceState);
+
+        RuntimePermissions::request(RuntimePermissions::recordAudio,
+                                    [this, deviceState](bool granted) {
+                                        setAudioChannels(granted ? 2 : 0, 2, deviceState.get());
+                                        bodyPanel.settingPanel.midiInputSelector.showEnabledInput(deviceManager);
+                                    });
+    }
+    else
+    {
+        // Specify the number of input and output channels that we want to open
+        setAudioChannels(2, 2, savedDeviceState.get());
+        bodyPanel.settingPanel.midiInputSelector.showEnabledInput(deviceManager);
+    }
+}
+
+MainComponent::~MainComponent()
+{
+    deviceManager.removeMidiInputDeviceCallback({}, this);
+    deviceManager.removeChangeListener(this);
+
+    // This shuts down the audio device and clears the audio source.
+    shutdownAudio();
+
+    beatAudioSource.saveSession();
+}
+
+//==============================================================================
+void MainComponent::prepareToPlay(int samplesPerBlockExpected, double sampleRate)
+{
+    // This function will be called when the audio device is started, or when
+    // its settings (i.e. sample rate, block size, etc) are changed.
+
+    // You can use this function to initialise any resources you might need,
+    // but be careful - it will be called on the audio thread, not the GUI thread.
+
+    // For more details, see the help for AudioProcessor::prepareToPlay()
+    beatAudioSource.prepareToPlay(samplesPerBlockExpected, sampleRate);
+}
+
+void MainComponent::getNextAudioBlock(const AudioSourceChannelInfo& bufferToFill)
+{
+    // Your audio-processing code goes here!
+
+    // For more details, see the help for AudioProcessor::getNextAudioBlock()
+
+    // Right now we are not producing any data, in which case we need to clear the buffer
+    // (to prevent the output of random noise)
+    // bufferToFill.clearActiveBufferRegion();
+    beatAudioSource.getNextAudioBlock(bufferToFill);
+}
+
+void MainComponent::releaseResources()
+{
+    // This will be called when the audio device stops, or when it is being
+    // restarted due to a setting change.
+
+    // For more details, see the help for AudioProcessor::releaseResources()
+    beatAudioSource.releaseResources();
+}
+
+//==============================================================================
+void MainComponent::paint(Graphics& g)
+{
+    // (Our component is opaque, so we must completely fill the background with a solid colour)
+    g.fillAll(getLookAndFeel().findColour(ResizableWindow::backgroundColourId));
+
+    // You can add your drawing code here!
+}
+
+void MainComponent::resized()
+{
+    // This is called when the MainContentComponent is resized.
+    // If you add any child components, this is where you should
+    // update their positions.
+    auto isPortrait = getHeight() > getWidth();
+
+    FlexBox fbGroup;
+    FlexBox fbContainer;
+    float margin = 8.0f;
+
+    if (isPortrait)
+    {
+        auto width = getWidth() - 2.0f * margin;
+        auto height = getHeight() - 3.0f * margin;
+
+        fbGroup.flexDirection = FlexBox::Direction::column;
+
+        FlexItem header(width, 123.2f, headerPanel);
+        FlexItem body(width, height * 0.8f, bodyPanel);
+
+        FlexItem::Margin headerPanelMargin;
+        headerPanelMargin.bottom = margin;
+        fbGroup.items.addArray({ header.withMargin(headerPanelMargin), body });
+    }
+    else
+    {
+        auto width = getWidth() - 3.0f * margin;
+        auto height = getHeight() - 2.0f * margin;
+
+        fbGroup.flexDirection = FlexBox::Direction::row;
+
+        FlexItem header(width * 0.25f, height, headerPanel);
+        FlexItem body(width * 0.75f, height, bodyPanel);
+
+        FlexItem::Margin headerPanelMargin;
+        headerPanelMargin.right = margin;
+        fbGroup.items.addArray({ header.withMargin(headerPanelMargin), body });
+    }
+
+    fbContainer.items.add(FlexItem(fbGroup).withMargin({ margin }));
+    fbContainer.performLayout(getLocalBounds().toFloat());
+}
+
+void MainComponent::changeListenerCallback(ChangeBroadcaster* source)
+{
+    if (source == &beatAudioSource)
+    {
+        auto& startButton = headerPanel.startButton;
+
+        // a control command may have started or stopped the transport
+        if (startButton.getToggleState() != beatAudioSource.isPlaying())
+            startButton.setToggleState(beatAudioSource.isPlaying(), sendNotificationSync);
+
+        if (beatAudioSource.isPlaying())
+            changeState(Playing);
+        else
+            changeState(Stopped);
+
+        auto& calibrator = beatAudioSource.getLatencyCalibrator();
+
+        if (calibratingLatency && !calibrator.isRunning())
+        {
+            calibratingLatency = false;
+
+            auto* device = deviceManager.getCurrentAudioDevice();
+
+            if (device != nullptr && calibrator.getRoundTripSamples() >= 0)
+                LatencyCalibrator::saveRoundTrip(LatencyCalibrator::getDeviceKey(*device), calibrator.getRoundTripSamples());
+
+            updateOutputLatency();
+
+            if (calibrator.getRoundTripSamples() < 0)
+                bodyPanel.settingPanel.latencyCalibration.latencyLabel.setText("No click came back, check the loopback", dontSendNotification);
+        }
+    }
+    else if (source == &deviceManager)
+    {
+        updateOutputLatency();
+    }
+}
+
+bool MainComponent::keyPressed(const KeyPress& key)
+{
+    // 1-9 recall the presets
+    auto presetIndex = (int) key.getTextCharacter() - (int) '1';
+
+    if (isPositiveAndBelow(presetIndex, 9))
+    {
+        musicMetre.recallPreset(presetIndex);
+        return true;
+    }
+
+    return false;
+}
+
+void MainComponent::handleIncomingMidiMessage(MidiInput*, const MidiMessage& message)
+{
+    // called on the MIDI thread, the recall itself happens on the message thread
+    if (message.isProgramChange())
+    {
+        requestedPreset = message.getProgramChangeNumber();
+        triggerAsyncUpdate();
+    }
+    else if (midiClockFollower.handleMessage(message))
+    {
+        if (message.isMidiStart() || message.isMidiContinue())
+            requestedTransport = TransportRequest::start;
+        else if (message.isMidiStop())
+            requestedTransport = TransportRequest::stop;
+
+        if (requestedTransport != TransportRequest::none)
+            triggerAsyncUpdate();
+
+        auto tempo = midiClockFollower.getTempo();
+
+        if (message.isMidiClock() && midiClockFollower.isLocked() && std::abs(tempo - musicMetre.getBPM()) >= 0.01f)
+        {
+            auto* tempoParameter = beatAudioSource.getValueTreeState().getParameter("tempo");
+            tempoParameter->setValueNotifyingHost(tempoParameter->convertTo0to1(tempo));
+        }
+    }
+}
+
+void MainComponent::updateClockSource()
+{
+    auto& sharedTransportBox = bodyPanel.settingPanel.sharedTransportBox;
+    auto sharedTransportMode = sharedTransportBox.getSelectedId();
+
+    // the audio thread lets go of the transport before the role is handed back
+    if (sharedTransportMode != SettingPanel::sharedTransportPublishId)
+    {
+        beatAudioSource.setTransportPublisher(nullptr);
+        sharedTransport.releasePublisher();
+    }
+    else if (sharedTransport.claimPublisher())
+    {
+        beatAudioSource.setTransportPublisher(&sharedTransport);
+    }
+    else
+    {
+        sharedTransportBox.setSelectedId(SettingPanel::sharedTransportOffId, dontSendNotification);
+        sharedTransportMode = SettingPanel::sharedTransportOffId;
+        AlertWindow::showMessageBoxAsync(AlertWindow::WarningIcon, "Shared transport", "Another instance already publishes its transport.");
+    }
+
+    sharedTransportFollower.setEnabled(sharedTransportMode == SettingPanel::sharedTransportFollowId);
+
+    // an external MIDI clock takes precedence over another instance
+    if (midiClockFollower.isEnabled())
+        beatAudioSource.setClockFollower(&midiClockFollower);
+    else if (sharedTransportFollower.isEnabled())
+        beatAudioSource.setClockFollower(&sharedTransportFollower);
+    else
+        beatAudioSource.setClockFollower(nullptr);
+}
+
+void MainComponent::updateOutputLatency()
+{
+    auto* device = deviceManager.getCurrentAudioDevice();
+
+    if (device == nullptr)
+        return;
+
+    auto reportedOutput = device->getOutputLatencyInSamples() + device->getCurrentBufferSizeSamples();
+    auto reportedInput = device->getInputLatencyInSamples() + device->getCurrentBufferSizeSamples();
+    auto roundTrip = LatencyCalibrator::loadRoundTrip(LatencyCalibrator::getDeviceKey(*device));
+
+    // only the round trip can be measured; split it the way the device reports its two halves
+    auto outputLatency = roundTrip >= 0 ? roundToInt(roundTrip * (double) reportedOutput / (reportedOutput + reportedInput))
+                                        : reportedOutput;
+
+    beatAudioSource.setOutputLatency(outputLatency);
+    bodyPanel.settingPanel.latencyCalibration.showLatency(roundTrip, outputLatency, device->getCurrentSampleRate());
+}
+
+void MainComponent::handleAsyncUpdate()
+{
+    auto presetIndex = requestedPreset.exchange(-1);
+
+    if (presetIndex >= 0)
+        musicMetre.recallPreset(presetIndex);
+
+    auto transport = requestedTransport.exchange(TransportRequest::none);
+    auto& startButton = headerPanel.startButton;
+
+    if ((transport == TransportRequest::start && !startButton.getToggleState())
+        || (transport == TransportRequest::stop && startButton.getToggleState()))
+        startButton.triggerClick();
+}
@@ -1,619 +1,1341 @@
-/*
-  ==============================================================================
-
-    This file was auto-generated!
-
-  ==============================================================================
-*/
-
-#pragma once
-
-#include "../JuceLibraryCode/JuceHeader.h"
-#include "Chronometro.h"
-
-class AppLookAndFeel : public LookAndFeel_V4
-{
-public:
-    AppLookAndFeel()
-    {
-        auto colourScheme = getDarkColourScheme();
-        colourScheme.setUIColour(ColourScheme::defaultText, Colours::lightseagreen);
-        colourScheme.setUIColour(ColourScheme::highlightedText, Colours::lightseagreen);
-        colourScheme.setUIColour(ColourScheme::outline, Colours::transparentBlack);
-        setColourScheme(colourScheme);
-        setColour(Label::textColourId, Colours::lightseagreen);
-        setColour(TextButton::buttonColourId, Colours::teal);
-        setColour(TextButton::buttonOnColourId, Colours::lemonchiffon);
-    }
-
-    Font getTextButtonFont(TextButton&, int buttonHeight) override
-    {
-        return { buttonHeight * 0.6f };
-    }
-
-    Font getLabelFont(Label& label) override
-    {
-        return { label.getHeight() * 0.6f };
-    }
-};
-
-class CircleBeatComponent : public Component
-{
-public:
-    CircleBeatComponent(bool fill) : fill(fill) {}
-
-    void paint(Graphics& g) override
-    {
-        g.setColour(Colours::lightseagreen);
-
-        auto lineThickness = 1.0f;
-
-        if (fill)
-        {
-            g.fillEllipse(lineThickness * 0.5f,
-                          lineThickness * 0.5f,
-                          getWidth() - lineThickness * 2,
-                          getHeight() - lineThickness * 2);
-        }
-        else
-        {
-            g.drawEllipse(lineThickness * 0.5f,
-                          lineThickness * 0.5f,
-                          getWidth() - lineThickness * 2,
-                          getHeight() - lineThickness * 2,
-                          lineThickness);
-        }
-    }
-
-    bool fill;
-
-private:
-    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(CircleBeatComponent)
-};
-
-class VisualBeatComponent : public Component, public Timer
-{
-public:
-    VisualBeatComponent() : leftCircleBeat(false), rightCircleBeat(true)
-    {
-        addAndMakeVisible(&leftCircleBeat);
-        addAndMakeVisible(&rightCircleBeat);
-    }
-
-    void paint(Graphics& g) override
-    {
-        g.fillAll(Colours::teal);
-    }
-
-    void resized() override
-    {
-        int diameter = getHeight() * 0.7;
-        int marginTop = getHeight() * 0.15;
-        int marginLeft = (getWidth() - 2 * diameter) / 3;
-        leftCircleBeat.setBounds(marginLeft, marginTop, diameter, diameter);
-        rightCircleBeat.setBounds(diameter + 2 * marginLeft, marginTop, diameter, diameter);
-    }
-
-    void mouseDown(const MouseEvent& event) override
-    {
-    }
-
-private:
-    void timerCallback() override
-    {
-        repaint();
-        std::swap(leftCircleBeat.fill, rightCircleBeat.fill);
-    }
-
-    CircleBeatComponent leftCircleBeat;
-    CircleBeatComponent rightCircleBeat;
-
-    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(VisualBeatComponent)
-};
-
-//==============================================================================
-/*
-    This component lives inside our window, and this is where you should put all
-    your controls and content.
-*/
-class MainComponent : public AudioAppComponent, public ChangeListener
-{
-public:
-    //==============================================================================
-    MainComponent();
-    ~MainComponent();
-
-    //==============================================================================
-    void prepareToPlay(int samplesPerBlockExpected, double sampleRate) override;
-    void getNextAudioBlock(const AudioSourceChannelInfo& bufferToFill) override;
-    void releaseResources() override;
-
-    //==============================================================================
-    void paint(Graphics& g) override;
-    void resized() override;
-
-    void changeListenerCallback(ChangeBroadcaster* source) override;
-
-private:
-    //==============================================================================
-    // Your private member variables go here...
-    enum TransportState
-    {
-        Stopped,
-        Starting,
-        Playing,
-        Stopping
-    };
-
-    void changeState(TransportState newState)
-    {
-        if (state != newState)
-        {
-            state = newState;
-
-            switch (state)
-            {
-                case Stopped:
-                    break;
-
-                case Starting:
-                    beatAudioSource.start();
-                    break;
-
-                case Playing:
-                    break;
-
-                case Stopping:
-                    beatAudioSource.stop();
-                    break;
-            }
-        }
-    }
-
-    void playButtonClicked()
-    {
-        if (state != Playing)
-        {
-            headerPanel.visualBeatRegion.startTimer(static_cast<int>(musicMetre.getIntervalPerBeat() * 1000));
-            changeState(Starting);
-        }
-    }
-
-    void stopButtonClicked()
-    {
-        if (state != Stopped)
-        {
-            headerPanel.visualBeatRegion.stopTimer();
-            changeState(Stopping);
-        }
-    }
-
-    class BPMLabel : public Label
-    {
-    public:
-        void setBPM(float BPM)
-        {
-            setText(String::toDecimalStringWithSignificantFigures(BPM, 5), dontSendNotification);
-        }
-    };
-
-    class NoteButton : public TextButton
-    {
-    public:
-        NoteButton(Music::Pulse& pulseToUse) : pulse(pulseToUse)
-        {
-            state = noteValueVector.begin();
-            while (state != noteValueVector.end() && *state != pulse.getNoteValue())
-                ++state;
-
-            setButtonText(String((int) *state));
-            onClick = [this] {
-                if (Music::PulseIterator::doesNoteButtonLock.exchange(true, std::memory_order_release) == false
-                    && Music::PulseIterator::doesPulseIteratorLock.load(std::memory_order_acquire) == false)
-                {
-                    if (++state == noteValueVector.end())
-                        state = noteValueVector.begin();
-
-                    setButtonText(String((int) *state));
-                    pulse.setNoteValue(*state);
-                }
-
-                Music::PulseIterator::doesNoteButtonLock.store(false, std::memory_order_release);
-
-                static_cast<BeatComponent*>(getParentComponent()->getParentComponent())->resized();
-            };
-        }
-
-        Music::Pulse& pulse;
-
-    private:
-        std::vector<Music::NoteValue>::iterator state;
-        std::vector<Music::NoteValue> noteValueVector {
-            Music::NoteValue::quarter,
-            Music::NoteValue::eighth,
-            Music::NoteValue::triplet,
-            Music::NoteValue::sixteenth
-        };
-    };
-
-    struct PulseComponent : public Component
-    {
-        PulseComponent(Music::Pulse& pulseToUse, bool shouldUseNoteButton = false) : pulse(pulseToUse)
-        {
-            if (shouldUseNoteButton)
-            {
-                noteButton.reset(new NoteButton(pulse));
-                addAndMakeVisible(noteButton.get());
-            }
-
-            hitButton.setToggleState(pulse.getHit(), dontSendNotification);
-            hitButton.onClick = [this] {
-                hitButton.setToggleState(!hitButton.getToggleState(), dontSendNotification);
-                pulse.setHit(hitButton.getToggleState());
-            };
-            addAndMakeVisible(&hitButton);
-
-            accentButton.setButtonText(">");
-            accentButton.onClick = [this] {
-                accentButton.setToggleState(!accentButton.getToggleState(), dontSendNotification);
-                pulse.setAccent(accentButton.getToggleState() ? 0.5f : 0.0f);
-            };
-            addAndMakeVisible(&accentButton);
-        }
-
-        void resized() override
-        {
-            FlexBox fbGroup;
-            FlexBox fb;
-
-            fbGroup.items.add(FlexItem(*noteButton).withFlex(1));
-            fbGroup.items.add(FlexItem(accentButton).withFlex(1));
-
-            fb.flexDirection = FlexBox::Direction::column;
-
-            fb.items.add(FlexItem(fbGroup).withMinWidth(getWidth()).withMinHeight(getHeight() / 3.0f));
-            fb.items.add(FlexItem(hitButton).withMinWidth(getWidth()).withMinHeight(getHeight() * 2.0f / 3.0f));
-
-            fb.performLayout(getLocalBounds().toFloat());
-        }
-
-        Music::Pulse& pulse;
-
-        std::unique_ptr<NoteButton> noteButton;
-        TextButton hitButton;
-        TextButton accentButton;
-    };
-
-    struct BeatComponent : public Component
-    {
-        BeatComponent(Music::Beat& beatToUse) : beat(beatToUse)
-        {
-            addAndMakeVisible(**pulseList.insert(pulseList.end(), std::make_unique<PulseComponent>(*beat[0], true)));
-            addChildComponent(**pulseList.insert(pulseList.end(), std::make_unique<PulseComponent>(*beat[1])));
-            addChildComponent(**pulseList.insert(pulseList.end(), std::make_unique<PulseComponent>(*beat[2])));
-            addChildComponent(**pulseList.insert(pulseList.end(), std::make_unique<PulseComponent>(*beat[3])));
-        }
-
-        void resized() override
-        {
-            FlexBox fb;
-
-            fb.flexDirection = FlexBox::Direction::row;
-
-            int n = (int) beat[0]->getNoteValue() / (int) Music::Metre::baseNoteValue;
-            auto last = pulseList.begin();
-
-            while (n-- > 0)
-                ++last;
-
-            for (auto it = pulseList.begin(); it != last; ++it)
-            {
-                (**it).setVisible(true);
-                fb.items.add(FlexItem(**it).withMinWidth(86.0f).withMinHeight(86.0f * 2.0f / 3.0f).withFlex(1));
-            }
-
-            for (auto it = last; it != pulseList.end(); ++it)
-                (**it).setVisible(false);
-
-            fb.performLayout(getLocalBounds().toFloat());
-        }
-
-        Music::Beat& beat;
-
-        std::list<std::unique_ptr<PulseComponent>> pulseList;
-    };
-
-    struct HeaderPanel : public Component
-    {
-        HeaderPanel(Music::Metre& metre) : musicMetre(metre)
-        {
-            tapButton.setButtonText("Tap");
-            tapButton.onClick = [this] {
-                musicMetre.setTapBPM();
-                BPMLabel.setBPM(musicMetre.getBPM());
-            };
-            addAndMakeVisible(&tapButton);
-
-            BPMLabel.setEditable(true);
-            BPMLabel.setBPM(musicMetre.getBPM());
-            BPMLabel.onTextChange = [this] {
-                auto bpm = BPMLabel.getText().getFloatValue();
-                musicMetre.setBPM(bpm);
-                BPMLabel.setBPM(musicMetre.getBPM());
-            };
-            addAndMakeVisible(&BPMLabel);
-
-            startButton.setButtonText("Start");
-            startButton.setClickingTogglesState(true);
-            startButton.onClick = [this] {
-                if (startButton.getToggleState())
-                {
-                    static_cast<MainComponent*>(getParentComponent())->playButtonClicked();
-                    startButton.setButtonText("Stop");
-                }
-                else
-                {
-                    static_cast<MainComponent*>(getParentComponent())->stopButtonClicked();
-                    startButton.setButtonText("Start");
-                }
-            };
-            addAndMakeVisible(&startButton);
-
-            settingButton.setButtonText("Setting");
-            settingButton.setClickingTogglesState(true);
-            settingButton.onClick = [this] {
-                auto* mainComponent = static_cast<MainComponent*>(getParentComponent());
-
-                if (settingButton.getToggleState())
-                    mainComponent->bodyPanel.setCurrentPanel(&mainComponent->bodyPanel.settingPanel);
-                else
-                    mainComponent->bodyPanel.setCurrentPanel(&mainComponent->bodyPanel.metreListPanel);
-            };
-            addAndMakeVisible(&settingButton);
-
-            addAndMakeVisible(&visualBeatRegion);
-        }
-
-        void resized() override
-        {
-            auto isPortrait = getHeight() > getWidth();
-
-            FlexBox fb1stGroup;
-            FlexBox fb2ndGroup;
-            FlexBox fbContainer;
-            float fb1stGroupFelxGrow, fb2ndGroupFlexGrow;
-
-            if (isPortrait)
-            {
-                fb1stGroup.flexDirection = FlexBox::Direction::column;
-                fb1stGroupFelxGrow = 3.0f;
-
-                fb1stGroup.items.add(FlexItem(tapButton).withMinWidth(154.0f).withMinHeight(66.0f).withFlex(1));
-                fb1stGroup.items.add(FlexItem(startButton).withMinWidth(154.0f).withMinHeight(66.0f).withFlex(1));
-                fb1stGroup.items.add(FlexItem(settingButton).withMinWidth(154.0f).withMinHeight(66.0f).withFlex(1));
-
-                fb2ndGroup.flexDirection = FlexBox::Direction::column;
-                fb2ndGroupFlexGrow = 2.0f;
-
-                FlexItem::Margin BPMLabelMargin;
-                BPMLabelMargin.bottom = 1.0f;
-                fb2ndGroup.items.add(FlexItem(BPMLabel).withMinWidth(154.0f).withMinHeight(66.0f).withMargin(BPMLabelMargin).withFlex(1));
-                fb2ndGroup.items.add(FlexItem(visualBeatRegion).withMinWidth(154.0f).withMinHeight(66.0f).withFlex(1));
-            }
-            else
-            {
-                fb1stGroup.flexDirection = FlexBox::Direction::row;
-                fb1stGroupFelxGrow = 1.0f;
-
-                fb1stGroup.items.add(FlexItem(tapButton).withMinWidth(114.0f).withMinHeight(56.0f).withFlex(1));
-                fb1stGroup.items.add(FlexItem(startButton).withMinWidth(114.0f).withMinHeight(56.0f).withFlex(1));
-                fb1stGroup.items.add(FlexItem(settingButton).withMinWidth(114.0f).withMinHeight(56.0f).withFlex(1));
-
-                fb2ndGroup.flexDirection = FlexBox::Direction::row;
-                fb2ndGroupFlexGrow = 1.0f;
-
-                FlexItem::Margin BPMLabelMargin;
-                BPMLabelMargin.right = 1.0f;
-                fb2ndGroup.items.add(FlexItem(BPMLabel).withMinWidth(114.0f).withMinHeight(56.0f).withMargin(BPMLabelMargin).withFlex(1));
-                fb2ndGroup.items.add(FlexItem(visualBeatRegion).withMinWidth(114.0f).withMinHeight(56.0f).withFlex(1));
-            }
-
-            fbContainer.flexDirection = FlexBox::Direction::column;
-
-            FlexItem::Margin fb1stGroupMargin;
-            fb1stGroupMargin.bottom = 8.0f;
-            fbContainer.items.addArray({ FlexItem(fb1stGroup).withFlex(fb1stGroupFelxGrow).withMargin(fb1stGroupMargin),
-                                         FlexItem(fb2ndGroup).withFlex(fb2ndGroupFlexGrow) });
-            fbContainer.performLayout(getLocalBounds().toFloat());
-        }
-
-        Music::Metre& musicMetre;
-
-        TextButton tapButton;
-        BPMLabel BPMLabel;
-        TextButton startButton;
-        TextButton settingButton;
-        VisualBeatComponent visualBeatRegion;
-    };
-
-    struct MetreListPanel : public Component
-    {
-        MetreListPanel(Music::Metre& metre) : musicMetre(metre)
-        {
-        }
-
-        void resized() override
-        {
-            FlexBox fb;
-
-            fb.flexWrap = FlexBox::Wrap::wrap;
-            fb.justifyContent = FlexBox::JustifyContent::flexStart;
-            fb.alignContent = FlexBox::AlignContent::flexStart;
-
-            FlexItem::Margin beatMargin;
-            beatMargin.bottom = 8.0f;
-
-            for (auto& metrePtr : beatList)
-                fb.items.add(FlexItem(*metrePtr)
-                                 .withWidth(getWidth())
-                                 .withHeight(getWidth() / 6.0f)
-                                 .withMinHeight(86.0f * 2.0f / 3.0f)
-                                 .withMargin(beatMargin));
-
-            fb.performLayout(getLocalBounds().toFloat());
-        }
-
-        void init()
-        {
-            auto last = --musicMetre.beatList.end();
-
-            for (auto it = musicMetre.beatList.begin(); it != last; ++it)
-                addAndMakeVisible(**beatList.insert(beatList.end(), std::make_unique<BeatComponent>(*it)));
-
-            resized();
-        }
-
-        Music::Metre& musicMetre;
-
-        std::list<std::unique_ptr<BeatComponent>> beatList;
-    };
-
-    struct SettingPanel : public Component
-    {
-        SettingPanel()
-        {
-            addAndMakeVisible(&wrapDecibelSlider);
-        }
-
-        void resized() override
-        {
-            auto isPortrait = getHeight() > getWidth();
-
-            FlexBox fb;
-
-            fb.flexDirection = FlexBox::Direction::column;
-
-            fb.items.add(FlexItem(wrapDecibelSlider).withFlex(0, 1, isPortrait ? getHeight() / 10.0f : getHeight() / 5.0f));
-            fb.items.add(FlexItem(*soundStallProcessorEditor).withFlex(0, 1, isPortrait ? getHeight() / 10.0f : getHeight() / 5.0f));
-
-            fb.performLayout(getLocalBounds().toFloat());
-        }
-
-        class DecibelSlider : public Slider
-        {
-        public:
-            DecibelSlider() {}
-
-            double getValueFromText(const String& text) override
-            {
-                auto minusInfinitydB = -100.0;
-
-                auto decibelText = text.upToFirstOccurrenceOf("dB", false, false).trim();
-
-                return decibelText.equalsIgnoreCase("-INF") ? minusInfinitydB
-                                                            : decibelText.getDoubleValue();
-            }
-
-            String getTextFromValue(double value) override { return Decibels::toString(value); }
-
-        private:
-            JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(DecibelSlider)
-        };
-
-        struct WrapDecibelSlider : public Component, public Slider::Listener
-        {
-            WrapDecibelSlider()
-            {
-                decibelSlider.setRange(-60, 0);
-                decibelSlider.setSkewFactorFromMidPoint(-10);
-                decibelSlider.setTextBoxStyle(Slider::TextBoxRight, false, 100, 20);
-                decibelSlider.setValue(Decibels::gainToDecibels(currentLevel));
-                decibelSlider.addListener(this);
-                addAndMakeVisible(&decibelSlider);
-
-                decibelLabel.setText("Gain", dontSendNotification);
-                addAndMakeVisible(&decibelLabel);
-            }
-
-            void resized() override
-            {
-                juce::FlexBox fb;
-
-                juce::FlexItem left(getWidth() * 0.2f, getHeight(), decibelLabel);
-                juce::FlexItem right(getWidth() * 0.8f, getHeight(), decibelSlider);
-
-                fb.items.addArray({ left, right });
-                fb.performLayout(getLocalBounds().toFloat());
-            }
-
-            void sliderValueChanged(Slider* slider) override
-            {
-                targetLevel = Decibels::decibelsToGain((float) decibelSlider.getValue());
-            }
-
-            DecibelSlider decibelSlider;
-            Label decibelLabel;
-            float currentLevel = 0.3f, targetLevel = 0.3f;
-        };
-
-        WrapDecibelSlider wrapDecibelSlider;
-        std::unique_ptr<AudioProcessorEditor> soundStallProcessorEditor;
-    };
-
-    struct BodyPanel : public Component
-    {
-        BodyPanel(Music::Metre& metre) : metreListPanel(metre)
-        {
-            addAndMakeVisible(&metreListPanel);
-        }
-
-        void resized() override
-        {
-            auto bounds = getLocalBounds();
-            metreListPanel.setBounds(bounds);
-            settingPanel.setBounds(bounds);
-        }
-
-        void setCurrentPanel(Component* panelToUse)
-        {
-            if (panelToUse != currentPanel)
-            {
-                if (currentPanel != nullptr)
-                {
-                    currentPanel->setVisible(false);
-                    removeChildComponent(currentPanel);
-                }
-
-                currentPanel = panelToUse;
-
-                if (panelToUse != nullptr)
-                {
-                    addChildComponent(panelToUse);
-                    panelToUse->setVisible(true);
-                    panelToUse->toFront(true);
-                }
-            }
-        }
-
-        MetreListPanel metreListPanel;
-        SettingPanel settingPanel;
-        Component* currentPanel = &metreListPanel;
-    };
-
-    AppLookAndFeel appLookAndFeel;
-
-    Music::Metre musicMetre;
-    BeatAudioSource beatAudioSource;
-
-    TransportState state;
-
-    HeaderPanel headerPanel;
-    BodyPanel bodyPanel;
-
-    OpenGLContext openGLContext;
-
-    float& currentLevel = bodyPanel.settingPanel.wrapDecibelSlider.currentLevel;
-    float& targetLevel = bodyPanel.settingPanel.wrapDecibelSlider.targetLevel;
-
-    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(MainComponent)
-};
+/*
+  ==============================================================================
+
+    This file was auto-generated!
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "Chronometro.h"
+#include "ControlSocket.h"
+#include "IdleTimeout.h"
+
+class AppLookAndFeel : public LookAndFeel_V4
+{
+public:
+    AppLookAndFeel()
+    {
+        auto colourScheme = getDarkColourScheme();
+        colourScheme.setUIColour(ColourScheme::defaultText, Colours::lightseagreen);
+        colourScheme.setUIColour(ColourScheme::highlightedText, Colours::lightseagreen);
+        colourScheme.setUIColour(ColourScheme::outline, Colours::transparentBlack);
+        setColourScheme(colourScheme);
+        setColour(Label::textColourId, Colours::lightseagreen);
+        setColour(TextButton::buttonColourId, Colours::teal);
+        setColour(TextButton::buttonOnColourId, Colours::lemonchiffon);
+    }
+
+    Font getTextButtonFont(TextButton&, int buttonHeight) override
+    {
+        return { buttonHeight * 0.6f };
+    }
+
+    Font getLabelFont(Label& label) override
+    {
+        return { label.getHeight() * 0.6f };
+    }
+};
+
+class CircleBeatComponent : public Component
+{
+public:
+    CircleBeatComponent(bool fill) : fill(fill) {}
+
+    void paint(Graphics& g) override
+    {
+        const TraceRecorder::ScopedEvent traceEvent("Beat Repaint", fill);
+
+        g.setColour(Colours::lightseagreen);
+
+        auto lineThickness = 1.0f;
+
+        if (fill)
+        {
+            g.fillEllipse(lineThickness * 0.5f,
+                          lineThickness * 0.5f,
+                          getWidth() - lineThickness * 2,
+                          getHeight() - lineThickness * 2);
+        }
+        else
+        {
+            g.drawEllipse(lineThickness * 0.5f,
+                          lineThickness * 0.5f,
+                          getWidth() - lineThickness * 2,
+                          getHeight() - lineThickness * 2,
+                          lineThickness);
+        }
+    }
+
+    bool fill;
+
+private:
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(CircleBeatComponent)
+};
+
+class VisualBeatComponent : public Component, public Timer
+{
+public:
+    VisualBeatComponent() : leftCircleBeat(false), rightCircleBeat(true)
+    {
+        addAndMakeVisible(&leftCircleBeat);
+        addAndMakeVisible(&rightCircleBeat);
+    }
+
+    void paint(Graphics& g) override
+    {
+        g.fillAll(Colours::teal);
+    }
+
+    void resized() override
+    {
+        int diameter = getHeight() * 0.7;
+        int marginTop = getHeight() * 0.15;
+        int marginLeft = (getWidth() - 2 * diameter) / 3;
+        leftCircleBeat.setBounds(marginLeft, marginTop, diameter, diameter);
+        rightCircleBeat.setBounds(diameter + 2 * marginLeft, marginTop, diameter, diameter);
+    }
+
+    void mouseDown(const MouseEvent& event) override
+    {
+    }
+
+    void setBeatAudioSource(BeatAudioSource* source) { beatAudioSource = source; }
+
+private:
+    // polled, so the circles swap when a beat is heard rather than when its block was rendered
+    void timerCallback() override
+    {
+        if (beatAudioSource == nullptr)
+            return;
+
+        auto beatCount = beatAudioSource->getAudibleBeatCount(Time::getMillisecondCounterHiRes());
+
+        if (beatCount != shownBeatCount)
+        {
+            shownBeatCount = beatCount;
+            TraceRecorder::instant("Beat Shown", beatCount);
+
+            repaint();
+            std::swap(leftCircleBeat.fill, rightCircleBeat.fill);
+        }
+    }
+
+    CircleBeatComponent leftCircleBeat;
+    CircleBeatComponent rightCircleBeat;
+
+    BeatAudioSource* beatAudioSource = nullptr;
+    int64 shownBeatCount = 0;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(VisualBeatComponent)
+};
+
+//==============================================================================
+/*
+    This component lives inside our window, and this is where you should put all
+    your controls and content.
+*/
+class MainComponent : public AudioAppComponent,
+                      public ChangeListener,
+                      private MidiInputCallback,
+                      private AsyncUpdater
+{
+public:
+    //==============================================================================
+    MainComponent();
+    ~MainComponent();
+
+    //==============================================================================
+    void prepareToPlay(int samplesPerBlockExpected, double sampleRate) override;
+    void getNextAudioBlock(const AudioSourceChannelInfo& bufferToFill) override;
+    void releaseResources() override;
+
+    //==============================================================================
+    void paint(Graphics& g) override;
+    void resized() override;
+
+    void changeListenerCallback(ChangeBroadcaster* source) override;
+
+    bool keyPressed(const KeyPress& key) override;
+
+private:
+    void handleIncomingMidiMessage(MidiInput* source, const MidiMessage& message) override;
+    void handleAsyncUpdate() override;
+    void updateClockSource();
+    void updateOutputLatency();
+
+    //==============================================================================
+    // Your private member variables go here...
+    enum TransportState
+    {
+        Stopped,
+        Starting,
+        Playing,
+        Stopping
+    };
+
+    void changeState(TransportState newState)
+    {
+        if (state != newState)
+        {
+            state = newState;
+
+            switch (state)
+            {
+                case Stopped:
+                    break;
+
+                case Starting:
+                    beatAudioSource.start();
+                    break;
+
+                case Playing:
+                    break;
+
+                case Stopping:
+                    beatAudioSource.stop();
+                    break;
+            }
+        }
+    }
+
+    void playButtonClicked()
+    {
+        if (state != Playing)
+        {
+            idleTimeout.resume();
+            headerPanel.visualBeatRegion.startTimerHz(60);
+            changeState(Starting);
+        }
+    }
+
+    void stopButtonClicked()
+    {
+        if (state != Stopped)
+        {
+            headerPanel.visualBeatRegion.stopTimer();
+            changeState(Stopping);
+        }
+    }
+
+    class BPMLabel : public Label
+    {
+    public:
+        void setBPM(float BPM)
+        {
+            setText(String::toDecimalStringWithSignificantFigures(BPM, 5), dontSendNotification);
+        }
+    };
+
+    class NoteButton : public TextButton
+    {
+    public:
+        NoteButton(Music::Pulse& pulseToUse, Music::NoteValue baseNoteValue) : pulse(&pulseToUse)
+        {
+            setPulse(pulseToUse, baseNoteValue);
+
+            onClick = [this] {
+                if (++state == noteValueVector.end())
+                    state = noteValueVector.begin();
+
+                setButtonText(String((int) *state));
+                pulse->setNoteValue(*state);
+
+                static_cast<BeatComponent*>(getParentComponent()->getParentComponent())->resized();
+                findParentComponentOfClass<MetreListPanel>()->patternChanged();
+            };
+        }
+
+        // a recycled row shows another beat, possibly of another metre
+        void setPulse(Music::Pulse& pulseToUse, Music::NoteValue baseNoteValue)
+        {
+            pulse = &pulseToUse;
+
+            // only the note values that divide a beat evenly, e.g. no triplets in a beat of an eighth
+            auto isUneven = [baseNoteValue](Music::NoteValue noteValue) { return (int) noteValue % (int) baseNoteValue != 0; };
+
+            noteValueVector = allNoteValues;
+            noteValueVector.erase(std::remove_if(noteValueVector.begin(), noteValueVector.end(), isUneven), noteValueVector.end());
+
+            refresh();
+        }
+
+        void refresh()
+        {
+            state = std::find(noteValueVector.begin(), noteValueVector.end(), pulse->getNoteValue());
+
+            if (state == noteValueVector.end())
+                state = noteValueVector.begin();
+
+            setButtonText(String((int) *state));
+        }
+
+    private:
+        Music::Pulse* pulse;
+
+        std::vector<Music::NoteValue>::iterator state;
+        std::vector<Music::NoteValue> noteValueVector;
+
+        inline static const std::vector<Music::NoteValue> allNoteValues {
+            Music::NoteValue::quarter,
+            Music::NoteValue::eighth,
+            Music::NoteValue::triplet,
+            Music::NoteValue::sixteenth
+        };
+    };
+
+    struct PulseComponent : public Component
+    {
+        PulseComponent(Music::Pulse& pulseToUse, bool shouldUseNoteButton = false, Music::NoteValue baseNoteValue = Music::NoteValue::quarter)
+            : pulse(&pulseToUse)
+        {
+            if (shouldUseNoteButton)
+            {
+                noteButton.reset(new NoteButton(pulseToUse, baseNoteValue));
+                addAndMakeVisible(noteButton.get());
+            }
+
+            hitButton.onClick = [this] {
+                hitButton.setToggleState(!hitButton.getToggleState(), dontSendNotification);
+                pulse->setHit(hitButton.getToggleState());
+                findParentComponentOfClass<MetreListPanel>()->patternChanged();
+            };
+            addAndMakeVisible(&hitButton);
+
+            accentButton.setButtonText(">");
+            accentButton.onClick = [this] {
+                accentButton.setToggleState(!accentButton.getToggleState(), dontSendNotification);
+                pulse->setAccent(accentButton.getToggleState() ? 1.0f : 0.0f);
+                findParentComponentOfClass<MetreListPanel>()->patternChanged();
+            };
+            addAndMakeVisible(&accentButton);
+
+            refresh();
+        }
+
+        void setPulse(Music::Pulse& pulseToUse, Music::NoteValue baseNoteValue)
+        {
+            pulse = &pulseToUse;
+
+            if (noteButton != nullptr)
+                noteButton->setPulse(pulseToUse, baseNoteValue);
+
+            refresh();
+        }
+
+        void refresh()
+        {
+            if (noteButton != nullptr)
+                noteButton->refresh();
+
+            hitButton.setToggleState(pulse->getHit(), dontSendNotification);
+            accentButton.setToggleState(pulse->getAccent() > 0.0f, dontSendNotification);
+        }
+
+        void resized() override
+        {
+            FlexBox fbGroup;
+            FlexBox fb;
+
+            if (noteButton != nullptr)
+                fbGroup.items.add(FlexItem(*noteButton).withFlex(1));
+
+            fbGroup.items.add(FlexItem(accentButton).withFlex(1));
+
+            fb.flexDirection = FlexBox::Direction::column;
+
+            fb.items.add(FlexItem(fbGroup).withMinWidth(getWidth()).withMinHeight(getHeight() / 3.0f));
+            fb.items.add(FlexItem(hitButton).withMinWidth(getWidth()).withMinHeight(getHeight() * 2.0f / 3.0f));
+
+            fb.performLayout(getLocalBounds().toFloat());
+        }
+
+        Music::Pulse* pulse;
+
+        std::unique_ptr<NoteButton> noteButton;
+        TextButton hitButton;
+        TextButton accentButton;
+    };
+
+    // a row of the beat list; the list keeps only the rows in view and rebinds them as it scrolls
+    struct BeatComponent : public Component
+    {
+        BeatComponent(Music::Beat& beatToUse, Music::NoteValue baseNoteValueToUse) : beat(&beatToUse), baseNoteValue(baseNoteValueToUse)
+        {
+            addAndMakeVisible(**pulseList.insert(pulseList.end(), std::make_unique<PulseComponent>(*beatToUse[0], true, baseNoteValue)));
+            addChildComponent(**pulseList.insert(pulseList.end(), std::make_unique<PulseComponent>(*beatToUse[1])));
+            addChildComponent(**pulseList.insert(pulseList.end(), std::make_unique<PulseComponent>(*beatToUse[2])));
+            addChildComponent(**pulseList.insert(pulseList.end(), std::make_unique<PulseComponent>(*beatToUse[3])));
+        }
+
+        void setBeat(Music::Beat& beatToUse, Music::NoteValue baseNoteValueToUse)
+        {
+            beat = &beatToUse;
+            baseNoteValue = baseNoteValueToUse;
+
+            auto pulse = beatToUse.begin();
+
+            for (auto& pulseComponent : pulseList)
+                pulseComponent->setPulse(**pulse++, baseNoteValue);
+
+            resized();
+        }
+
+        void resized() override
+        {
+            FlexBox fb;
+
+            fb.flexDirection = FlexBox::Direction::row;
+
+            int n = (int) (*beat)[0]->getNoteValue() / (int) baseNoteValue;
+            auto last = pulseList.begin();
+
+            while (n-- > 0)
+                ++last;
+
+            for (auto it = pulseList.begin(); it != last; ++it)
+            {
+                (**it).setVisible(true);
+                fb.items.add(FlexItem(**it).withMinWidth(86.0f).withMinHeight(86.0f * 2.0f / 3.0f).withFlex(1));
+            }
+
+            for (auto it = last; it != pulseList.end(); ++it)
+                (**it).setVisible(false);
+
+            fb.performLayout(getLocalBounds().withTrimmedBottom(rowGap).toFloat());
+        }
+
+        void refresh()
+        {
+            for (auto& pulseComponent : pulseList)
+                pulseComponent->refresh();
+
+            resized();
+        }
+
+        static constexpr int rowGap = 8;
+
+        Music::Beat* beat;
+        Music::NoteValue baseNoteValue;
+
+        std::list<std::unique_ptr<PulseComponent>> pulseList;
+    };
+
+    struct HeaderPanel : public Component, private AudioProcessorValueTreeState::Listener, private AsyncUpdater
+    {
+        HeaderPanel(Music::Metre& metre, AudioProcessorValueTreeState& parameters)
+            : musicMetre(metre), parameters(parameters)
+        {
+            tapButton.setButtonText("Tap");
+            tapButton.onClick = [this] {
+                musicMetre.setTapBPM();
+                setTempoParameter(musicMetre.getBPM());
+            };
+            addAndMakeVisible(&tapButton);
+
+            BPMLabel.setEditable(true);
+            BPMLabel.setBPM(musicMetre.getBPM());
+            BPMLabel.onTextChange = [this] {
+                auto bpm = BPMLabel.getText().getFloatValue();
+                musicMetre.setBPM(bpm);
+                setTempoParameter(musicMetre.getBPM());
+            };
+            addAndMakeVisible(&BPMLabel);
+
+            startButton.setButtonText("Start");
+            startButton.setClickingTogglesState(true);
+            startButton.onClick = [this] {
+                if (startButton.getToggleState())
+                {
+                    static_cast<MainComponent*>(getParentComponent())->playButtonClicked();
+                    startButton.setButtonText("Stop");
+                }
+                else
+                {
+                    static_cast<MainComponent*>(getParentComponent())->stopButtonClicked();
+                    startButton.setButtonText("Start");
+                }
+            };
+            addAndMakeVisible(&startButton);
+
+            settingButton.setButtonText("Setting");
+            settingButton.setClickingTogglesState(true);
+            settingButton.onClick = [this] {
+                auto* mainComponent = static_cast<MainComponent*>(getParentComponent());
+
+                if (settingButton.getToggleState())
+                    mainComponent->bodyPanel.setCurrentPanel(&mainComponent->bodyPanel.settingPanel);
+                else
+                    mainComponent->bodyPanel.setCurrentPanel(&mainComponent->bodyPanel.metreListPanel);
+            };
+            addAndMakeVisible(&settingButton);
+
+            addAndMakeVisible(&visualBeatRegion);
+
+            parameters.addParameterListener("tempo", this);
+        }
+
+        ~HeaderPanel() override
+        {
+            parameters.removeParameterListener("tempo", this);
+        }
+
+        void setTempoParameter(float bpm)
+        {
+            auto* tempo = parameters.getParameter("tempo");
+            tempo->beginChangeGesture();
+            tempo->setValueNotifyingHost(tempo->convertTo0to1(bpm));
+            tempo->endChangeGesture();
+
+            BPMLabel.setBPM(musicMetre.getBPM());
+        }
+
+        void parameterChanged(const String&, float) override
+        {
+            // tempo automation may arrive on the audio thread
+            triggerAsyncUpdate();
+        }
+
+        void handleAsyncUpdate() override
+        {
+            BPMLabel.setBPM(musicMetre.getBPM());
+        }
+
+        void resized() override
+        {
+            auto isPortrait = getHeight() > getWidth();
+
+            FlexBox fb1stGroup;
+            FlexBox fb2ndGroup;
+            FlexBox fbContainer;
+            float fb1stGroupFelxGrow, fb2ndGroupFlexGrow;
+
+            if (isPortrait)
+            {
+                fb1stGroup.flexDirection = FlexBox::Direction::column;
+                fb1stGroupFelxGrow = 3.0f;
+
+                fb1stGroup.items.add(FlexItem(tapButton).withMinWidth(154.0f).withMinHeight(66.0f).withFlex(1));
+                fb1stGroup.items.add(FlexItem(startButton).withMinWidth(154.0f).withMinHeight(66.0f).withFlex(1));
+                fb1stGroup.items.add(FlexItem(settingButton).withMinWidth(154.0f).withMinHeight(66.0f).withFlex(1));
+
+                fb2ndGroup.flexDirection = FlexBox::Direction::column;
+                fb2ndGroupFlexGrow = 2.0f;
+
+                FlexItem::Margin BPMLabelMargin;
+                BPMLabelMargin.bottom = 1.0f;
+                fb2ndGroup.items.add(FlexItem(BPMLabel).withMinWidth(154.0f).withMinHeight(66.0f).withMargin(BPMLabelMargin).withFlex(1));
+                fb2ndGroup.items.add(FlexItem(visualBeatRegion).withMinWidth(154.0f).withMinHeight(66.0f).withFlex(1));
+            }
+            else
+            {
+                fb1stGroup.flexDirection = FlexBox::Direction::row;
+                fb1stGroupFelxGrow = 1.0f;
+
+                fb1stGroup.items.add(FlexItem(tapButton).withMinWidth(114.0f).withMinHeight(56.0f).withFlex(1));
+                fb1stGroup.items.add(FlexItem(startButton).withMinWidth(114.0f).withMinHeight(56.0f).withFlex(1));
+                fb1stGroup.items.add(FlexItem(settingButton).withMinWidth(114.0f).withMinHeight(56.0f).withFlex(1));
+
+                fb2ndGroup.flexDirection = FlexBox::Direction::row;
+                fb2ndGroupFlexGrow = 1.0f;
+
+                FlexItem::Margin BPMLabelMargin;
+                BPMLabelMargin.right = 1.0f;
+                fb2ndGroup.items.add(FlexItem(BPMLabel).withMinWidth(114.0f).withMinHeight(56.0f).withMargin(BPMLabelMargin).withFlex(1));
+                fb2ndGroup.items.add(FlexItem(visualBeatRegion).withMinWidth(114.0f).withMinHeight(56.0f).withFlex(1));
+            }
+
+            fbContainer.flexDirection = FlexBox::Direction::column;
+
+            FlexItem::Margin fb1stGroupMargin;
+            fb1stGroupMargin.bottom = 8.0f;
+            fbContainer.items.addArray({ FlexItem(fb1stGroup).withFlex(fb1stGroupFelxGrow).withMargin(fb1stGroupMargin),
+                                         FlexItem(fb2ndGroup).withFlex(fb2ndGroupFlexGrow) });
+            fbContainer.performLayout(getLocalBounds().toFloat());
+        }
+
+        Music::Metre& musicMetre;
+        AudioProcessorValueTreeState& parameters;
+
+        TextButton tapButton;
+        BPMLabel BPMLabel;
+        TextButton startButton;
+        TextButton settingButton;
+        VisualBeatComponent visualBeatRegion;
+    };
+
+    struct MetreListPanel : public Component, public ChangeListener, private ListBoxModel
+    {
+        MetreListPanel(Music::Metre& metre) : musicMetre(metre)
+        {
+            beatListBox.setModel(this);
+            beatListBox.setColour(ListBox::backgroundColourId, Colours::transparentBlack);
+            beatListBox.setRowSelectedOnMouseDown(false);
+            addAndMakeVisible(&beatListBox);
+
+            presetBox.onChange = [this] {
+                if (presetBox.getSelectedItemIndex() >= 0)
+                    musicMetre.recallPreset(presetBox.getSelectedItemIndex());
+            };
+            presetBox.setEditableText(true);
+            presetBox.setTextWhenNothingSelected("Preset");
+            addAndMakeVisible(&presetBox);
+
+            storeButton.setButtonText("Store");
+            storeButton.onClick = [this] {
+                auto presetIndex = presetBox.getSelectedItemIndex();
+                auto name = presetBox.getText().isNotEmpty() ? presetBox.getText() : "Preset " + String(musicMetre.presetBank.size() + 1);
+
+                musicMetre.storePreset(presetIndex, name);
+                updatePresetBox();
+            };
+            addAndMakeVisible(&storeButton);
+
+            metreBox.addItemList({ "4/4", "3/4", "2/4", "5/4 3+2", "6/8 3+3", "7/8 2+2+3", "7/8 3+2+2", "9/8 2+2+2+3", "12/8 3+3+3+3" }, 1);
+            metreBox.setEditableText(true);
+            metreBox.onChange = [this] {
+                if (!musicMetre.setTimeSignature(metreBox.getText()))
+                    metreBox.setText(musicMetre.getTimeSignature(), dontSendNotification);
+            };
+            addAndMakeVisible(&metreBox);
+
+            musicMetre.addChangeListener(this);
+        }
+
+        ~MetreListPanel() override
+        {
+            musicMetre.removeChangeListener(this);
+        }
+
+        void resized() override
+        {
+            auto bounds = getLocalBounds();
+            FlexBox fb;
+
+            fb.items.add(FlexItem(presetBox).withFlex(0.45f));
+            fb.items.add(FlexItem(metreBox).withFlex(0.3f));
+            fb.items.add(FlexItem(storeButton).withFlex(0.25f));
+
+            fb.performLayout(bounds.removeFromTop(40).toFloat());
+            bounds.removeFromTop(BeatComponent::rowGap);
+
+            beatListBox.setRowHeight(jmax(58, getWidth() / 6) + BeatComponent::rowGap);
+            beatListBox.setBounds(bounds);
+        }
+
+        void init()
+        {
+            updateBeats();
+            updatePresetBox();
+        }
+
+        // one row per beat of the bar, however long; the Metre keeps the beats it no longer plays,
+        // so they come back as they were when the bar grows again
+        void updateBeats()
+        {
+            shownBeats.clear();
+
+            for (auto& beat : musicMetre.beatList)
+            {
+                if ((int) shownBeats.size() == musicMetre.getBeatsPerBar())
+                    break;
+
+                shownBeats.push_back(&beat);
+            }
+
+            metreBox.setText(musicMetre.getTimeSignature(), dontSendNotification);
+
+            // rebinds the rows in view, which are all the components there are
+            beatListBox.updateContent();
+        }
+
+        void patternChanged()
+        {
+            musicMetre.commitPattern();
+        }
+
+        void updatePresetBox()
+        {
+            presetBox.clear(dontSendNotification);
+
+            for (auto i = 0; i < musicMetre.presetBank.size(); ++i)
+                presetBox.addItem(musicMetre.presetBank.getPreset(i)->name, i + 1);
+
+            presetBox.setSelectedItemIndex(musicMetre.getCurrentPreset(), dontSendNotification);
+        }
+
+        void changeListenerCallback(ChangeBroadcaster*) override
+        {
+            // the pattern was replaced as a whole, e.g. by a preset or a restored session
+            updateBeats();
+            presetBox.setSelectedItemIndex(musicMetre.getCurrentPreset(), dontSendNotification);
+        }
+
+        int getNumRows() override { return (int) shownBeats.size(); }
+
+        void paintListBoxItem(int, Graphics&, int, int, bool) override {}
+
+        // a row scrolled out of view is handed back here to show the beat scrolled into view
+        Component* refreshComponentForRow(int row, bool, Component* existingComponentToUpdate) override
+        {
+            std::unique_ptr<BeatComponent> beatComponent(static_cast<BeatComponent*>(existingComponentToUpdate));
+
+            if (!isPositiveAndBelow(row, (int) shownBeats.size()))
+                return nullptr;
+
+            if (beatComponent == nullptr)
+                beatComponent = std::make_unique<BeatComponent>(*shownBeats[(size_t) row], musicMetre.baseNoteValue);
+            else
+                beatComponent->setBeat(*shownBeats[(size_t) row], musicMetre.baseNoteValue);
+
+            return beatComponent.release();
+        }
+
+        Music::Metre& musicMetre;
+
+        ComboBox presetBox, metreBox;
+        TextButton storeButton;
+
+        ListBox beatListBox;
+        std::vector<Music::Beat*> shownBeats;
+    };
+
+    struct SettingPanel : public Component
+    {
+        SettingPanel()
+        {
+            addAndMakeVisible(&wrapDecibelSlider);
+            addAndMakeVisible(&callbackMonitorDisplay);
+            addAndMakeVisible(&midiOutputSelector);
+            addAndMakeVisible(&midiInputSelector);
+            addAndMakeVisible(&midiClockSyncButton);
+
+            sharedTransportBox.addItem("Shared transport off", sharedTransportOffId);
+            sharedTransportBox.addItem("Publish shared transport", sharedTransportPublishId);
+            sharedTransportBox.addItem("Follow shared transport", sharedTransportFollowId);
+            sharedTransportBox.setSelectedId(sharedTransportOffId, dontSendNotification);
+            addAndMakeVisible(&sharedTransportBox);
+
+            for (auto minutes : { 0, 1, 5, 15 })
+                addIdleTimeoutItem(minutes);
+
+            idleTimeoutBox.setSelectedId(1, dontSendNotification);
+            addAndMakeVisible(&idleTimeoutBox);
+
+            addAndMakeVisible(&latencyCalibration);
+        }
+
+        // 0 keeps the device open
+        int getIdleTimeoutMinutes() const { return idleTimeoutBox.getSelectedId() - 1; }
+
+        // the session may hold any number of minutes, e.g. one set in the headless configuration
+        void showIdleTimeoutMinutes(int minutes)
+        {
+            if (idleTimeoutBox.indexOfItemId(minutes + 1) < 0)
+                addIdleTimeoutItem(minutes);
+
+            idleTimeoutBox.setSelectedId(minutes + 1, dontSendNotification);
+        }
+
+        void addIdleTimeoutItem(int minutes)
+        {
+            idleTimeoutBox.addItem(minutes == 0 ? String("Keep the audio device open when stopped")
+                                                : "Close the audio device after " + String(minutes) + " min stopped",
+                                   minutes + 1);
+        }
+
+        // the panels that poll only do so while they can be seen
+        void visibilityChanged() override
+        {
+            callbackMonitorDisplay.setActive(isVisible());
+
+            if (audioDevicePanel != nullptr)
+                audioDevicePanel->setActive(isVisible());
+        }
+
+        void resized() override
+        {
+            auto isPortrait = getHeight() > getWidth();
+
+            FlexBox fb;
+
+            fb.flexDirection = FlexBox::Direction::column;
+
+            fb.items.add(FlexItem(wrapDecibelSlider).withFlex(0, 1, isPortrait ? getHeight() / 10.0f : getHeight() / 5.0f));
+            fb.items.add(FlexItem(callbackMonitorDisplay).withFlex(0, 1, isPortrait ? getHeight() / 10.0f : getHeight() / 5.0f));
+            fb.items.add(FlexItem(midiOutputSelector).withFlex(0, 1, isPortrait ? getHeight() / 10.0f : getHeight() / 5.0f));
+            fb.items.add(FlexItem(midiInputSelector).withFlex(0, 1, isPortrait ? getHeight() / 10.0f : getHeight() / 5.0f));
+            fb.items.add(FlexItem(midiClockSyncButton).withFlex(0, 1, isPortrait ? getHeight() / 10.0f : getHeight() / 5.0f));
+            fb.items.add(FlexItem(sharedTransportBox).withFlex(0, 1, isPortrait ? getHeight() / 10.0f : getHeight() / 5.0f));
+            fb.items.add(FlexItem(idleTimeoutBox).withFlex(0, 1, isPortrait ? getHeight() / 10.0f : getHeight() / 5.0f));
+            fb.items.add(FlexItem(*audioDevicePanel).withFlex(0, 1, isPortrait ? getHeight() / 5.0f : getHeight() / 2.5f));
+            fb.items.add(FlexItem(latencyCalibration).withFlex(0, 1, isPortrait ? getHeight() / 10.0f : getHeight() / 5.0f));
+            fb.items.add(FlexItem(*soundStallProcessorEditor).withFlex(1, 1, isPortrait ? getHeight() / 10.0f : getHeight() / 5.0f));
+
+            fb.performLayout(getLocalBounds().toFloat());
+        }
+
+        class DecibelSlider : public Slider
+        {
+        public:
+            DecibelSlider() {}
+
+            double getValueFromText(const String& text) override
+            {
+                auto minusInfinitydB = -100.0;
+
+                auto decibelText = text.upToFirstOccurrenceOf("dB", false, false).trim();
+
+                return decibelText.equalsIgnoreCase("-INF") ? minusInfinitydB
+                                                            : decibelText.getDoubleValue();
+            }
+
+            String getTextFromValue(double value) override { return Decibels::toString(value); }
+
+        private:
+            JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(DecibelSlider)
+        };
+
+        struct WrapDecibelSlider : public Component
+        {
+            WrapDecibelSlider()
+            {
+                decibelSlider.setTextBoxStyle(Slider::TextBoxRight, false, 100, 20);
+                addAndMakeVisible(&decibelSlider);
+
+                decibelLabel.setText("Gain", dontSendNotification);
+                addAndMakeVisible(&decibelLabel);
+            }
+
+            void resized() override
+            {
+                juce::FlexBox fb;
+
+                juce::FlexItem left(getWidth() * 0.2f, getHeight(), decibelLabel);
+                juce::FlexItem right(getWidth() * 0.8f, getHeight(), decibelSlider);
+
+                fb.items.addArray({ left, right });
+                fb.performLayout(getLocalBounds().toFloat());
+            }
+
+            void attach(AudioProcessorValueTreeState& parameters)
+            {
+                // the attachment takes range and skew from the "gain" parameter
+                attachment.reset(new AudioProcessorValueTreeState::SliderAttachment(parameters, "gain", decibelSlider));
+            }
+
+            DecibelSlider decibelSlider;
+            Label decibelLabel;
+
+            std::unique_ptr<AudioProcessorValueTreeState::SliderAttachment> attachment;
+        };
+
+        // What the audio callback used of its budget over the last half second. Overruns are ours,
+        // late callbacks the device's.
+        struct CallbackMonitorDisplay : public Component, private Timer
+        {
+            CallbackMonitorDisplay()
+            {
+                loadLabel.setText("Callback", dontSendNotification);
+                addAndMakeVisible(&loadLabel);
+
+                addAndMakeVisible(&statisticsLabel);
+            }
+
+            void resized() override
+            {
+                juce::FlexBox fb;
+
+                juce::FlexItem left(getWidth() * 0.2f, getHeight(), loadLabel);
+                juce::FlexItem right(getWidth() * 0.8f, getHeight(), statisticsLabel);
+
+                fb.items.addArray({ left, right });
+                fb.performLayout(getLocalBounds().toFloat());
+            }
+
+            void setCallbackMonitor(CallbackMonitor* monitorToUse)
+            {
+                callbackMonitor = monitorToUse;
+                setActive(active);
+            }
+
+            void setActive(bool shouldBeActive)
+            {
+                active = shouldBeActive;
+
+                if (callbackMonitor != nullptr && active)
+                    startTimer(500);
+                else
+                    stopTimer();
+            }
+
+        private:
+            void timerCallback() override
+            {
+                auto statistics = callbackMonitor->collect();
+
+                if (statistics.numBlocks == 0)
+                {
+                    statisticsLabel.setText("No callbacks", dontSendNotification);
+                    return;
+                }
+
+                auto toPercent = [](double load) { return String(roundToInt(100.0 * load)) + "%"; };
+
+                overruns += statistics.numOverruns;
+                lateCallbacks += statistics.numLateCallbacks;
+
+                statisticsLabel.setText("min " + toPercent(statistics.minLoad) + ", avg " + toPercent(statistics.averageLoad)
+                                            + ", p99 " + toPercent(statistics.p99Load) + ", max " + toPercent(statistics.maxLoad)
+                                            + "\njitter " + String(statistics.maxJitterMs, 2) + " ms, "
+                                            + String(overruns) + " overruns, " + String(lateCallbacks) + " late",
+                                        dontSendNotification);
+
+                if (statistics.numOverruns + statistics.numLateCallbacks > 0)
+                    statisticsLabel.setColour(Label::textColourId, Colours::orangered);
+                else
+                    statisticsLabel.removeColour(Label::textColourId);
+            }
+
+            CallbackMonitor* callbackMonitor = nullptr;
+            bool active = false;
+            int overruns = 0, lateCallbacks = 0;
+
+            Label loadLabel, statisticsLabel;
+        };
+
+        struct MidiOutputSelector : public Component
+        {
+            MidiOutputSelector()
+            {
+                midiOutputBox.addItem("Off", offId);
+#if !JUCE_WINDOWS
+                midiOutputBox.addItem("Chronometro (virtual port)", virtualPortId);
+#endif
+
+                for (auto i = 0; i < devices.size(); ++i)
+                    midiOutputBox.addItem(devices[i].name, firstDeviceId + i);
+
+                midiOutputBox.onChange = [this] { openSelectedOutput(); };
+                addAndMakeVisible(&midiOutputBox);
+
+                midiOutputLabel.setText("MIDI Out", dontSendNotification);
+                addAndMakeVisible(&midiOutputLabel);
+            }
+
+            void resized() override
+            {
+                juce::FlexBox fb;
+
+                juce::FlexItem left(getWidth() * 0.2f, getHeight(), midiOutputLabel);
+                juce::FlexItem right(getWidth() * 0.8f, getHeight(), midiOutputBox);
+
+                fb.items.addArray({ left, right });
+                fb.performLayout(getLocalBounds().toFloat());
+            }
+
+            void openSelectedOutput()
+            {
+                std::unique_ptr<MidiOutput> midiOutput;
+                auto selectedId = midiOutputBox.getSelectedId();
+
+                if (selectedId == virtualPortId)
+                    midiOutput = MidiOutput::createNewDevice(ProjectInfo::projectName);
+                else if (selectedId >= firstDeviceId)
+                    midiOutput = MidiOutput::openDevice(devices[selectedId - firstDeviceId].identifier);
+
+                if (onOutputChange != nullptr)
+                    onOutputChange(std::move(midiOutput));
+            }
+
+            enum
+            {
+                offId = 1,
+                virtualPortId,
+                firstDeviceId
+            };
+
+            Array<MidiDeviceInfo> devices = MidiOutput::getAvailableDevices();
+
+            ComboBox midiOutputBox;
+            Label midiOutputLabel;
+
+            std::function<void(std::unique_ptr<MidiOutput>)> onOutputChange;
+        };
+
+        // The one input that program changes and the MIDI clock are taken from; the others stay as
+        // the device settings have them, closed unless chosen here before
+        struct MidiInputSelector : public Component
+        {
+            MidiInputSelector()
+            {
+                midiInputBox.addItem("Off", offId);
+
+                for (auto i = 0; i < devices.size(); ++i)
+                    midiInputBox.addItem(devices[i].name, firstDeviceId + i);
+
+                midiInputBox.setSelectedId(offId, dontSendNotification);
+                midiInputBox.onChange = [this] {
+                    if (onInputChange != nullptr)
+                        onInputChange(getSelectedIdentifier());
+                };
+                addAndMakeVisible(&midiInputBox);
+
+                midiInputLabel.setText("MIDI In", dontSendNotification);
+                addAndMakeVisible(&midiInputLabel);
+            }
+
+            void resized() override
+            {
+                juce::FlexBox fb;
+
+                juce::FlexItem left(getWidth() * 0.2f, getHeight(), midiInputLabel);
+                juce::FlexItem right(getWidth() * 0.8f, getHeight(), midiInputBox);
+
+                fb.items.addArray({ left, right });
+                fb.performLayout(getLocalBounds().toFloat());
+            }
+
+            // shows the input the saved device state opened, if any
+            void showEnabledInput(AudioDeviceManager& deviceManager)
+            {
+                for (auto i = 0; i < devices.size(); ++i)
+                    if (deviceManager.isMidiInputDeviceEnabled(devices[i].identifier))
+                    {
+                        midiInputBox.setSelectedId(firstDeviceId + i, dontSendNotification);
+                        return;
+                    }
+            }
+
+            String getSelectedIdentifier() const
+            {
+                auto selectedId = midiInputBox.getSelectedId();
+                return selectedId >= firstDeviceId ? devices[selectedId - firstDeviceId].identifier : String();
+            }
+
+            enum
+            {
+                offId = 1,
+                firstDeviceId
+            };
+
+            Array<MidiDeviceInfo> devices = MidiInput::getAvailableDevices();
+
+            ComboBox midiInputBox;
+            Label midiInputLabel;
+
+            std::function<void(const String&)> onInputChange;
+        };
+
+        // Chooses the device, sample rate and buffer size, and keeps them for the next start. The load
+        // of the audio callback is measured for every buffer size that has been played, so the
+        // smallest one that is still safe can be picked.
+        struct AudioDevicePanel : public Component, private ChangeListener, private Timer
+        {
+            AudioDevicePanel(AudioDeviceManager& manager) : deviceManager(manager)
+            {
+                deviceBox.onChange = [this] { applySetup(); };
+                sampleRateBox.onChange = [this] { applySetup(); };
+                bufferSizeBox.onChange = [this] { applySetup(); };
+                outputOnlyButton.onClick = [this] { applySetup(); };
+
+                addAndMakeVisible(&deviceBox);
+                addAndMakeVisible(&outputOnlyButton);
+                addAndMakeVisible(&sampleRateBox);
+                addAndMakeVisible(&bufferSizeBox);
+
+                deviceManager.addChangeListener(this);
+                updateBoxes();
+            }
+
+            void setActive(bool shouldBeActive)
+            {
+                if (shouldBeActive)
+                    startTimer(500);
+                else
+                    stopTimer();
+            }
+
+            ~AudioDevicePanel() override
+            {
+                deviceManager.removeChangeListener(this);
+            }
+
+            void resized() override
+            {
+                auto bounds = getLocalBounds();
+                auto top = bounds.removeFromTop(bounds.getHeight() / 2);
+
+                outputOnlyButton.setBounds(top.removeFromRight(top.getWidth() * 3 / 10));
+                deviceBox.setBounds(top);
+                sampleRateBox.setBounds(bounds.removeFromLeft(bounds.getWidth() * 4 / 10));
+                bufferSizeBox.setBounds(bounds);
+            }
+
+            static File getDeviceStateFile()
+            {
+                return File::getSpecialLocation(File::userApplicationDataDirectory)
+                    .getChildFile(ProjectInfo::projectName)
+                    .getChildFile("AudioDevice.xml");
+            }
+
+        private:
+            void changeListenerCallback(ChangeBroadcaster*) override
+            {
+                updateBoxes();
+            }
+
+            void timerCallback() override
+            {
+                auto* device = deviceManager.getCurrentAudioDevice();
+
+                if (device == nullptr || !device->isPlaying())
+                    return;
+
+                // a decaying peak, since a single slow callback is what causes a dropout
+                auto& load = callbackLoads[device->getCurrentBufferSizeSamples()];
+                load = jmax(deviceManager.getCpuUsage(), load * 0.95);
+
+                for (auto bufferSize : device->getAvailableBufferSizes())
+                    bufferSizeBox.changeItemText(bufferSize, getBufferSizeText(bufferSize, device->getCurrentSampleRate()));
+            }
+
+            String getBufferSizeText(int bufferSize, double sampleRate) const
+            {
+                auto text = String(bufferSize) + " samples (" + String(1000.0 * bufferSize / sampleRate, 1) + " ms)";
+                auto load = callbackLoads.find(bufferSize);
+
+                if (load != callbackLoads.end())
+                    text << ", load " << roundToInt(100.0 * load->second) << "%";
+
+                return text;
+            }
+
+            void updateBoxes()
+            {
+                auto setup = deviceManager.getAudioDeviceSetup();
+
+                deviceBox.clear(dontSendNotification);
+                sampleRateBox.clear(dontSendNotification);
+                bufferSizeBox.clear(dontSendNotification);
+
+                if (auto* type = deviceManager.getCurrentDeviceTypeObject())
+                {
+                    auto names = type->getDeviceNames(false);
+
+                    for (auto i = 0; i < names.size(); ++i)
+                        deviceBox.addItem(names[i], i + 1);
+
+                    deviceBox.setSelectedId(names.indexOf(setup.outputDeviceName) + 1, dontSendNotification);
+                }
+
+                if (auto* device = deviceManager.getCurrentAudioDevice())
+                {
+                    for (auto sampleRate : device->getAvailableSampleRates())
+                        sampleRateBox.addItem(String(sampleRate) + " Hz", roundToInt(sampleRate));
+
+                    for (auto bufferSize : device->getAvailableBufferSizes())
+                        bufferSizeBox.addItem(getBufferSizeText(bufferSize, device->getCurrentSampleRate()), bufferSize);
+
+                    sampleRateBox.setSelectedId(roundToInt(device->getCurrentSampleRate()), dontSendNotification);
+                    bufferSizeBox.setSelectedId(device->getCurrentBufferSizeSamples(), dontSendNotification);
+                }
+
+                outputOnlyButton.setToggleState(setup.inputDeviceName.isEmpty(), dontSendNotification);
+            }
+
+            void applySetup()
+            {
+                auto setup = deviceManager.getAudioDeviceSetup();
+
+                setup.outputDeviceName = deviceBox.getText();
+
+                if (outputOnlyButton.getToggleState())
+                {
+                    setup.inputDeviceName = {};
+                    setup.inputChannels.clear();
+                    setup.useDefaultInputChannels = false;
+                }
+                else
+                {
+                    // the same interface for the inputs, if it has any, e.g. for the latency calibration
+                    auto* type = deviceManager.getCurrentDeviceTypeObject();
+                    auto inputNames = type != nullptr ? type->getDeviceNames(true) : StringArray();
+
+                    setup.inputDeviceName = inputNames.contains(setup.outputDeviceName) ? setup.outputDeviceName : inputNames[0];
+                    setup.useDefaultInputChannels = true;
+                }
+
+                if (sampleRateBox.getSelectedId() > 0)
+                    setup.sampleRate = sampleRateBox.getSelectedId();
+
+                if (bufferSizeBox.getSelectedId() > 0)
+                    setup.bufferSize = bufferSizeBox.getSelectedId();
+
+                auto error = deviceManager.setAudioDeviceSetup(setup, true);
+
+                if (error.isNotEmpty())
+                {
+                    AlertWindow::showMessageBoxAsync(AlertWindow::WarningIcon, "Audio device", error);
+                    return;
+                }
+
+                saveDeviceState(deviceManager);
+            }
+
+        public:
+            // the MIDI inputs are part of the state, so the input choice is kept as well
+            static void saveDeviceState(AudioDeviceManager& deviceManager)
+            {
+                if (auto state = deviceManager.createStateXml())
+                {
+                    getDeviceStateFile().getParentDirectory().createDirectory();
+                    state->writeTo(getDeviceStateFile());
+                }
+            }
+
+        private:
+
+            AudioDeviceManager& deviceManager;
+
+            ComboBox deviceBox, sampleRateBox, bufferSizeBox;
+            ToggleButton outputOnlyButton { "Output only" };
+
+            std::map<int, double> callbackLoads;
+        };
+
+        // needs a loopback cable from an output to an input while it runs
+        struct LatencyCalibration : public Component
+        {
+            LatencyCalibration()
+            {
+                calibrateButton.setButtonText("Calibrate");
+                addAndMakeVisible(&calibrateButton);
+
+                latencyLabel.setText("Latency", dontSendNotification);
+                addAndMakeVisible(&latencyLabel);
+            }
+
+            void resized() override
+            {
+                juce::FlexBox fb;
+
+                juce::FlexItem left(getWidth() * 0.7f, getHeight(), latencyLabel);
+                juce::FlexItem right(getWidth() * 0.3f, getHeight(), calibrateButton);
+
+                fb.items.addArray({ left, right });
+                fb.performLayout(getLocalBounds().toFloat());
+            }
+
+            void showLatency(int roundTripSamples, int outputLatencySamples, double sampleRate)
+            {
+                auto toMs = [sampleRate](int samples) { return String(1000.0 * samples / sampleRate, 1) + " ms"; };
+
+                if (roundTripSamples >= 0)
+                    latencyLabel.setText("Round trip " + toMs(roundTripSamples) + ", output " + toMs(outputLatencySamples), dontSendNotification);
+                else
+                    latencyLabel.setText("Output " + toMs(outputLatencySamples) + " (not calibrated)", dontSendNotification);
+            }
+
+            TextButton calibrateButton;
+            Label latencyLabel;
+        };
+
+        WrapDecibelSlider wrapDecibelSlider;
+        CallbackMonitorDisplay callbackMonitorDisplay;
+        MidiOutputSelector midiOutputSelector;
+        MidiInputSelector midiInputSelector;
+        ToggleButton midiClockSyncButton { "Follow MIDI clock" };
+
+        enum
+        {
+            sharedTransportOffId = 1,
+            sharedTransportPublishId,
+            sharedTransportFollowId
+        };
+
+        ComboBox sharedTransportBox;
+        ComboBox idleTimeoutBox;
+        LatencyCalibration latencyCalibration;
+        std::unique_ptr<AudioDevicePanel> audioDevicePanel;
+        std::unique_ptr<AudioProcessorEditor> soundStallProcessorEditor;
+    };
+
+    struct BodyPanel : public Component
+    {
+        BodyPanel(Music::Metre& metre) : metreListPanel(metre)
+        {
+            addAndMakeVisible(&metreListPanel);
+        }
+
+        void resized() override
+        {
+            auto bounds = getLocalBounds();
+            metreListPanel.setBounds(bounds);
+            settingPanel.setBounds(bounds);
+        }
+
+        void setCurrentPanel(Component* panelToUse)
+        {
+            if (panelToUse != currentPanel)
+            {
+                if (currentPanel != nullptr)
+                {
+                    currentPanel->setVisible(false);
+                    removeChildComponent(currentPanel);
+                }
+
+                currentPanel = panelToUse;
+
+                if (panelToUse != nullptr)
+                {
+                    addChildComponent(panelToUse);
+                    panelToUse->setVisible(true);
+                    panelToUse->toFront(true);
+                }
+            }
+        }
+
+        MetreListPanel metreListPanel;
+        SettingPanel settingPanel;
+        Component* currentPanel = &metreListPanel;
+    };
+
+    AppLookAndFeel appLookAndFeel;
+
+    Music::Metre musicMetre;
+    BeatAudioSource beatAudioSource;
+
+    TransportState state;
+
+    HeaderPanel headerPanel;
+    BodyPanel bodyPanel;
+
+    OpenGLContext openGLContext;
+
+    MidiClockFollower midiClockFollower;
+
+    SharedTransport sharedTransport;
+    SharedTransportFollower sharedTransportFollower { sharedTransport };
+
+    ControlSocket controlSocket { beatAudioSource, musicMetre };
+
+    enum class TransportRequest
+    {
+        none,
+        start,
+        stop
+    };
+
+    bool calibratingLatency = false;
+
+    // the audio device is closed after the timeout of the settings, and opened again on a start
+    AudioDeviceIdleTimeout idleTimeout { deviceManager, beatAudioSource };
+
+    std::atomic<int> requestedPreset { -1 };
+    std::atomic<TransportRequest> requestedTransport { TransportRequest::none };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(MainComponent)
+};
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "Chronometro.h"
+
+// The MIDI output self-test, run by "--midi-check". A thread plays the part of the audio device as
+// in the real-time check, and the MIDI of its blocks goes out through a virtual port that this
+// process opens again as an input. After a few beats at 120 BPM the start, stop, notes and clock
+// that came back are compared with what the pattern asks for, and a mismatch makes the process exit
+// with 1. Virtual ports exist on Linux and macOS only.
+class MidiClockCheck : private Thread, private Timer, private MidiInputCallback
+{
+public:
+    MidiClockCheck() : Thread("Simulated Audio Device"), beatAudioSource(musicMetre)
+    {
+        beatAudioSource.prepareToPlay(blockSize, sampleRate);
+
+        auto midiOutput = MidiOutput::createNewDevice(portName);
+
+        for (auto& device : MidiInput::getAvailableDevices())
+            if (device.name == portName)
+                midiInput = MidiInput::openDevice(device.identifier, this);
+
+        if (midiOutput == nullptr || midiInput == nullptr)
+        {
+            Logger::writeToLog("Cannot open the virtual MIDI port " + portName.quoted());
+            finish(false);
+            return;
+        }
+
+        midiInput->start();
+        beatAudioSource.setMidiOutput(std::move(midiOutput));
+
+        startThread(9);
+        beatAudioSource.start();
+        startTimer(playMilliseconds);
+    }
+
+    ~MidiClockCheck() override
+    {
+        stopTimer();
+        stopThread(2000);
+
+        if (midiInput != nullptr)
+            midiInput->stop();
+
+        beatAudioSource.setMidiOutput(nullptr);
+        beatAudioSource.releaseResources();
+    }
+
+private:
+    void run() override
+    {
+        AudioSampleBuffer buffer(2, blockSize);
+        auto blockMilliseconds = 1000.0 * blockSize / sampleRate;
+        auto nextBlockTime = Time::getMillisecondCounterHiRes();
+
+        while (!threadShouldExit())
+        {
+            beatAudioSource.getNextAudioBlock(AudioSourceChannelInfo(buffer));
+
+            nextBlockTime += blockMilliseconds;
+            Time::waitForMillisecondCounter((uint32) nextBlockTime);
+        }
+    }
+
+    // MIDI thread
+    void handleIncomingMidiMessage(MidiInput*, const MidiMessage& message) override
+    {
+        if (message.isMidiStart())
+            ++numStarts;
+        else if (message.isMidiStop())
+            ++numStops;
+        else if (message.isNoteOn())
+            ++numNotes;
+        else if (message.isMidiClock())
+        {
+            if (numClocks++ == 0)
+                firstClockTime = message.getTimeStamp();
+
+            lastClockTime = message.getTimeStamp();
+        }
+    }
+
+    void timerCallback() override
+    {
+        // the stop goes out with the next block, and takes the sender's headroom to arrive
+        if (beatAudioSource.isPlaying() || beatAudioSource.hasPendingCommands())
+        {
+            beatAudioSource.stop();
+            startTimer(settleMilliseconds);
+            return;
+        }
+
+        stopTimer();
+        stopThread(2000);
+
+        // one note per beat of the default 4/4, and 24 clocks per beat counted from each onset
+        auto notes = numNotes.load();
+        auto clocks = numClocks.load();
+        auto expectedInterval = 60.0 / 120.0 / MidiClockGenerator::pulsesPerQuarterNote;
+        auto interval = clocks > 1 ? (lastClockTime.load() - firstClockTime.load()) / (clocks - 1) : 0.0;
+
+        StringArray failures;
+
+        if (numStarts != 1 || numStops != 1)
+            failures.add(String(numStarts.load()) + " starts and " + String(numStops.load()) + " stops, expected 1 each");
+
+        if (notes < 2)
+            failures.add(String(notes) + " notes, expected one per beat");
+
+        if (clocks <= MidiClockGenerator::pulsesPerQuarterNote * (notes - 1) || clocks > MidiClockGenerator::pulsesPerQuarterNote * notes)
+            failures.add(String(clocks) + " clocks for " + String(notes) + " beats");
+
+        if (std::abs(interval - expectedInterval) > 0.1 * expectedInterval)
+            failures.add("clock interval " + String(interval * 1000.0, 2) + " ms, expected " + String(expectedInterval * 1000.0, 2) + " ms");
+
+        for (auto& failure : failures)
+            Logger::writeToLog(failure);
+
+        Logger::writeToLog("MIDI check: " + String(notes) + " notes, " + String(clocks) + " clocks, " + (failures.isEmpty() ? "passed" : "failed"));
+        finish(failures.isEmpty());
+    }
+
+    static void finish(bool passed)
+    {
+        JUCEApplicationBase::getInstance()->setApplicationReturnValue(passed ? 0 : 1);
+        JUCEApplicationBase::quit();
+    }
+
+    static constexpr int blockSize = 256;
+    static constexpr double sampleRate = 48000.0;
+    static constexpr int playMilliseconds = 4000;
+    static constexpr int settleMilliseconds = 500;
+
+    const String portName { String(ProjectInfo::projectName) + " MIDI Check" };
+
+    Music::Metre musicMetre;
+    BeatAudioSource beatAudioSource;
+    std::unique_ptr<MidiInput> midiInput;
+
+    std::atomic<int> numStarts { 0 }, numStops { 0 }, numNotes { 0 }, numClocks { 0 };
+    std::atomic<double> firstClockTime { 0.0 }, lastClockTime { 0.0 };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(MidiClockCheck)
+};
@@ -0,0 +1,329 @@
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "Music.h"
+
+// Turns the pulse onsets of a block into MIDI clock, start/stop and notes at their exact sample offsets.
+class MidiClockGenerator
+{
+public:
+    void start(MidiBuffer& midiBuffer)
+    {
+        midiBuffer.addEvent(MidiMessage::midiStart(), 0);
+
+        ticksRemaining = 0;
+        noteOffPosition = -1;
+    }
+
+    void stop(MidiBuffer& midiBuffer)
+    {
+        if (noteOffPosition >= 0)
+            midiBuffer.addEvent(MidiMessage::noteOff(channel, noteNumber), 0);
+
+        midiBuffer.addEvent(MidiMessage::midiStop(), 0);
+
+        ticksRemaining = 0;
+        noteOffPosition = -1;
+    }
+
+    void process(MidiBuffer& midiBuffer, const Music::Metre& metre, int numSamples, double sampleRate)
+    {
+        auto* events = metre.getEvents();
+        auto numEvents = metre.getNumEvents();
+        auto samplesPerBeat = metre.getSampleRatePerBeat();
+
+        // MIDI clock counts quarter notes, a beat of an eighth gets half of their ticks
+        auto ticksPerBeat = pulsesPerQuarterNote * 4 / (int) metre.getPlayingBaseNoteValue();
+
+        for (auto i = 0; i < numEvents; ++i)
+        {
+            auto& event = events[i];
+
+            addClockTicks(midiBuffer, event.samplePosition);
+            addNoteOff(midiBuffer, event.samplePosition);
+
+            // every beat restarts its ticks on the onset, so the clock never drifts from the click
+            if (event.isBeatStart)
+            {
+                nextTickPosition = event.samplePosition;
+                tickInterval = samplesPerBeat / ticksPerBeat;
+                ticksRemaining = ticksPerBeat;
+            }
+
+            if (event.hit)
+            {
+                auto velocity = (uint8) jlimit(1, 127, 80 + roundToInt(event.accent * 47.0f));
+
+                midiBuffer.addEvent(MidiMessage::noteOn(channel, noteNumber, velocity), event.samplePosition);
+                noteOffPosition = event.samplePosition + roundToInt(noteLengthSeconds * sampleRate);
+            }
+        }
+
+        addClockTicks(midiBuffer, numSamples);
+        addNoteOff(midiBuffer, numSamples);
+
+        nextTickPosition -= numSamples;
+
+        if (noteOffPosition >= 0)
+            noteOffPosition -= numSamples;
+    }
+
+    static constexpr int pulsesPerQuarterNote = 24;
+
+private:
+    void addClockTicks(MidiBuffer& midiBuffer, int endPosition)
+    {
+        while (ticksRemaining > 0 && nextTickPosition < endPosition)
+        {
+            midiBuffer.addEvent(MidiMessage::midiClock(), jmax(0, roundToInt(nextTickPosition)));
+
+            nextTickPosition += tickInterval;
+            --ticksRemaining;
+        }
+    }
+
+    void addNoteOff(MidiBuffer& midiBuffer, int endPosition)
+    {
+        if (noteOffPosition >= 0 && noteOffPosition < endPosition)
+        {
+            midiBuffer.addEvent(MidiMessage::noteOff(channel, noteNumber), noteOffPosition);
+            noteOffPosition = -1;
+        }
+    }
+
+    const int channel = 10;
+    const int noteNumber = 37;
+    const double noteLengthSeconds = 0.02;
+
+    double nextTickPosition = 0.0, tickInterval = 0.0;
+    int ticksRemaining = 0;
+    int noteOffPosition = -1;
+};
+
+// Delivers the MIDI of each audio block to an output device from its own thread, at the time
+// each message's sample offset corresponds to. The audio thread only writes into a FIFO.
+class MidiOutputSender : private Thread
+{
+public:
+    MidiOutputSender() : Thread("MIDI Output") {}
+
+    ~MidiOutputSender() override
+    {
+        stopThread(1000);
+    }
+
+    void setOutput(std::unique_ptr<MidiOutput> outputToUse)
+    {
+        enabled = false;
+        stopThread(1000);
+
+        // whatever was queued for the old port is dropped rather than sent late to the new one
+        fifo.finishedRead(fifo.getNumReady());
+
+        midiOutput = std::move(outputToUse);
+
+        if (midiOutput != nullptr)
+        {
+            startThread(9);
+            enabled = true;
+        }
+    }
+
+    bool hasOutput() const { return enabled; }
+
+    void send(const MidiBuffer& midiBuffer, double blockStartTime, int numSamples, double sampleRate)
+    {
+        if (!enabled)
+            return;
+
+        // one block of headroom, so every message of a block is due after the callback has queued it
+        auto latencyMs = 1000.0 * numSamples / sampleRate;
+
+        for (const auto metadata : midiBuffer)
+        {
+            if (metadata.numBytes > 3)
+                continue;
+
+            int start1, size1, start2, size2;
+            fifo.prepareToWrite(1, start1, size1, start2, size2);
+
+            if (size1 == 0)
+                return; // the device is not keeping up, drop the rest of the block
+
+            auto& pending = queue[(size_t) start1];
+            std::copy_n(metadata.data, metadata.numBytes, pending.data);
+            pending.size = metadata.numBytes;
+            pending.time = blockStartTime + latencyMs + 1000.0 * metadata.samplePosition / sampleRate;
+
+            fifo.finishedWrite(1);
+        }
+    }
+
+private:
+    struct PendingMessage
+    {
+        uint8 data[3];
+        int size;
+        double time;
+    };
+
+    void run() override
+    {
+        while (!threadShouldExit())
+        {
+            int start1, size1, start2, size2;
+            fifo.prepareToRead(1, start1, size1, start2, size2);
+
+            if (size1 == 0)
+            {
+                wait(1);
+                continue;
+            }
+
+            auto& pending = queue[(size_t) start1];
+            auto delay = pending.time - Time::getMillisecondCounterHiRes();
+
+            if (delay > 2.0)
+            {
+                wait(1);
+                continue;
+            }
+
+            if (delay > 0.0)
+            {
+                Thread::yield();
+                continue;
+            }
+
+            midiOutput->sendMessageNow(MidiMessage(pending.data, pending.size));
+            fifo.finishedRead(1);
+        }
+    }
+
+    static constexpr int queueSize = 1024;
+
+    std::unique_ptr<MidiOutput> midiOutput;
+    std::atomic<bool> enabled { false };
+
+    AbstractFifo fifo { queueSize };
+    std::array<PendingMessage, queueSize> queue;
+};
+
+// Follows an external MIDI clock. Incoming tick timestamps carry USB and driver jitter, so they
+// are smoothed by a second order phase-locked loop before they set the tempo and beat phase.
+class MidiClockFollower : public Music::ClockFollower
+{
+public:
+    // the loop state belongs to the MIDI thread, which starts over at its next tick
+    void setEnabled(bool shouldBeEnabled)
+    {
+        resetRequested = true;
+        enabled = shouldBeEnabled;
+    }
+
+    bool isEnabled() const { return enabled; }
+    bool isLocked() const override { return enabled && locked && !resetRequested; }
+
+    // MIDI thread, returns true if the message belonged to the clock
+    bool handleMessage(const MidiMessage& message)
+    {
+        if (!enabled)
+            return false;
+
+        if (message.isMidiClock())
+        {
+            handleClock(message.getTimeStamp() * 1000.0);
+            return true;
+        }
+
+        if (message.isMidiStart())
+        {
+            // the first clock after a start is the downbeat
+            tickCount = 0;
+            return true;
+        }
+
+        return message.isMidiStop() || message.isMidiContinue();
+    }
+
+    // in beats of the playing metre, e.g. twice the clock's quarter-note tempo for a beat of an eighth
+    float getTempo() const override
+    {
+        auto beatPeriod = tickPeriodMs.load() * ticksPerBeat.load();
+        return beatPeriod > 0.0 ? (float) (60000.0 / beatPeriod) : 120.0f;
+    }
+
+    void setBaseNoteValue(Music::NoteValue baseNoteValue) override
+    {
+        ticksPerBeat.store(jmax(1, MidiClockGenerator::pulsesPerQuarterNote * 4 / (int) baseNoteValue), std::memory_order_relaxed);
+    }
+
+    double getPhaseError(double onsetTime, int /*beat*/) const override
+    {
+        auto beatTime = lastBeatTime.load();
+        auto beatPeriod = tickPeriodMs.load() * ticksPerBeat.load();
+
+        if (beatPeriod <= 0.0)
+            return 0.0;
+
+        auto nearestBeat = beatTime + beatPeriod * std::round((onsetTime - beatTime) / beatPeriod);
+        return onsetTime - nearestBeat;
+    }
+
+private:
+    void handleClock(double time)
+    {
+        if (resetRequested.exchange(false))
+        {
+            numTicks = 0;
+            locked = false;
+        }
+
+        if (numTicks == 0)
+        {
+            predictedTime = time;
+        }
+        else if (numTicks == 1 || std::abs(time - predictedTime) > 0.5 * tickPeriod)
+        {
+            // (re)acquire from the raw interval, e.g. after a jump in tempo or a dropout
+            tickPeriod = time - lastTickTime;
+            predictedTime = time;
+            locked = false;
+        }
+        else
+        {
+            auto error = time - predictedTime;
+
+            predictedTime += phaseGain * error;
+            tickPeriod += frequencyGain * error;
+            locked = true;
+        }
+
+        lastTickTime = time;
+        ++numTicks;
+
+        if (numTicks >= 2 && tickPeriod > 0.0)
+        {
+            // the beats of the metre, so an eighth onset is pulled to an eighth of the clock
+            if (tickCount % ticksPerBeat.load() == 0)
+                lastBeatTime = predictedTime;
+
+            tickPeriodMs = tickPeriod;
+        }
+
+        ++tickCount;
+        predictedTime += tickPeriod;
+    }
+
+    // loop gains per tick: settles within about half a beat of 24 ticks
+    const double phaseGain = 0.25;
+    const double frequencyGain = 0.04;
+
+    std::atomic<bool> enabled { false }, locked { false }, resetRequested { false };
+    std::atomic<int> ticksPerBeat { MidiClockGenerator::pulsesPerQuarterNote };
+    std::atomic<double> lastBeatTime { 0.0 }, tickPeriodMs { 0.0 };
+
+    double predictedTime = 0.0, lastTickTime = 0.0, tickPeriod = 0.0;
+    int numTicks = 0;
+    int64 tickCount = 0;
+};
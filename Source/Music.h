@@ -1,5 +1,7 @@
 #pragma once
 
+#include "TraceRecorder.h"
+
 class Music
 {
 public:
@@ -14,7 +16,9 @@ public:
     };
 
     class Pulse;
-    class PulseIterator;
+    struct Groove;
+    class Pattern;
+    class PresetBank;
     class Metre;
 
     using Beat = std::vector<std::unique_ptr<Pulse>>;
@@ -22,8 +26,8 @@ public:
     class Pulse
     {
     public:
-        Pulse(bool hit, float accent, NoteValue noteValue, float timeLength, Beat& owner)
-            : index(0), hit(hit), noteValue(noteValue), sampleLength(timeLength), owner(owner)
+        Pulse(bool hit, float accent, NoteValue noteValue, Beat& owner)
+            : hit(hit), noteValue(noteValue), owner(owner)
         {
             this->accent = jlimit(0.0f, 1.0f, accent);
         }
@@ -31,113 +35,424 @@ public:
         Pulse(const Pulse&) = delete;
         Pulse& operator=(const Pulse&) = delete;
 
-        bool getHit() { return hit; }
+        bool getHit() { return hit.load(); }
         void setHit(bool hitToUse) { hit = hitToUse; }
-        float getAccent() { return accent; }
-        void setAccent(float accentToUse) { accent = accentToUse; }
+        float getAccent() { return accent.load(); }
+        void setAccent(float accentToUse) { accent = jlimit(0.0f, 1.0f, accentToUse); }
         NoteValue getNoteValue() { return noteValue; }
         void setNoteValue(NoteValue noteValueToUse)
         {
-            auto localSampleLength = Metre::convertToSampleLength(noteValueToUse);
-
             for (auto& pulse : owner)
-            {
                 pulse->noteValue = noteValueToUse;
-                pulse->sampleLength = localSampleLength;
-            }
         }
 
-        friend class PulseIterator;
         friend class Metre;
 
     private:
-        int index;
-        bool hit;
-        float accent;
+        std::atomic<bool> hit;
+        std::atomic<float> accent;
         NoteValue noteValue;
-        float sampleLength;
 
         Beat& owner;
     };
 
-    class PulseIterator
+    // Micro-timing for the pulses of a beat: the i-th offset moves the onset of the i-th pulse of
+    // every beat by that share of a pulse, later if positive. The offsets repeat across the beat, and
+    // only apply to beats whose number of pulses they divide, so a swing of pairs leaves triplets alone.
+    struct Groove
+    {
+        String name;
+        std::vector<float> offsets;
+
+        // the share of a pair of pulses taken by the first, from 0.5 (straight) to 0.75 (dotted)
+        static Groove swing(float ratio)
+        {
+            return { "Swing", { 0.0f, 2.0f * jlimit(0.5f, 0.75f, ratio) - 1.0f } };
+        }
+
+        float getOffset(int pulse, int numPulses) const
+        {
+            if (offsets.empty() || numPulses % (int) offsets.size() != 0)
+                return 0.0f;
+
+            // no pulse may shrink to nothing
+            return jlimit(-0.45f, 0.45f, offsets[(size_t) (pulse % (int) offsets.size())]);
+        }
+    };
+
+    // An immutable snapshot of the beat list, flattened into the steps the audio thread plays.
+    // The message thread builds and publishes it; the audio thread never sees the editable beats.
+    class Pattern : public ReferenceCountedObject
     {
     public:
-        PulseIterator() = default;
+        using Ptr = ReferenceCountedObjectPtr<Pattern>;
+
+        struct Cell
+        {
+            bool hit;
+            float accent;
+        };
+
+        struct BeatCells
+        {
+            NoteValue noteValue;
+            std::vector<Cell> cells;
+        };
+
+        // consecutive beats counted as one, e.g. the 2, 2 and 3 eighths of a 7/8 bar; the first
+        // pulse of a group is accented at least as much as the group
+        struct Group
+        {
+            int numBeats;
+            float accent;
+        };
+
+        // position and length are in beats of the base note value, with the groove applied
+        struct Step
+        {
+            NoteValue noteValue;
+            bool hit;
+            float accent;
+            int beat;
+            double position; // from the start of the bar
+            double length;
+            int pulse; // within its beat
+            int count; // the beat's number within its group, from 0, e.g. for a spoken count
+        };
+
+        Pattern(const String& name, std::vector<BeatCells> beatsToUse, NoteValue baseNoteValueToUse,
+                std::vector<Group> groupsToUse = {}, const Groove& groove = {})
+            : name(name), beats(std::move(beatsToUse)), baseNoteValue(baseNoteValueToUse), groups(std::move(groupsToUse))
+        {
+            for (auto beat = 0; beat < (int) beats.size(); ++beat)
+            {
+                auto& beatCells = beats[(size_t) beat];
+                auto numPulses = jlimit(1, (int) beatCells.cells.size(), (int) beatCells.noteValue / (int) baseNoteValue);
+                auto pulseLength = (double) baseNoteValue / (double) beatCells.noteValue;
+
+                beatStarts.push_back((int) steps.size());
+
+                for (auto i = 0; i < numPulses; ++i)
+                {
+                    steps.push_back({ beatCells.noteValue, beatCells.cells[(size_t) i].hit, beatCells.cells[(size_t) i].accent, beat, length, pulseLength, i, beat });
+                    length += pulseLength;
+                }
+            }
+
+            applyGroups();
+            applyGroove(groove);
+        }
+
+        const std::vector<Step>& getSteps() const { return steps; }
+        const std::vector<BeatCells>& getBeats() const { return beats; }
+        const std::vector<Group>& getGroups() const { return groups; }
+        NoteValue getBaseNoteValue() const { return baseNoteValue; }
+
+        // in beats of the base note value
+        double getLength() const { return length; }
+
+        int getFirstStepOfBeat(int beat) const
+        {
+            return isPositiveAndBelow(beat, (int) beatStarts.size()) ? beatStarts[(size_t) beat] : 0;
+        }
+
+        void writeTo(OutputStream& stream) const
+        {
+            stream.writeCompressedInt((int) beats.size());
+
+            for (auto& beatCells : beats)
+            {
+                stream.writeByte((char) beatCells.noteValue);
+                stream.writeCompressedInt((int) beatCells.cells.size());
+
+                for (auto& cell : beatCells.cells)
+                {
+                    stream.writeBool(cell.hit);
+                    stream.writeFloat(cell.accent);
+                }
+            }
+
+            stream.writeByte((char) baseNoteValue);
+            stream.writeCompressedInt((int) groups.size());
+
+            for (auto& group : groups)
+            {
+                stream.writeCompressedInt(group.numBeats);
+                stream.writeFloat(group.accent);
+            }
+        }
+
+        // patterns written before the metre was stored are all in quarters, without groups
+        static Ptr readFrom(InputStream& stream, const String& name, bool hasMetre)
+        {
+            auto numBeats = stream.readCompressedInt();
+
+            if (numBeats < 1 || numBeats > maxBeats)
+                return nullptr;
+
+            std::vector<BeatCells> beats;
+
+            for (auto i = 0; i < numBeats; ++i)
+            {
+                auto noteValue = static_cast<NoteValue>(stream.readByte());
+                auto numCells = stream.readCompressedInt();
+
+                if (stream.isExhausted() || !isValidNoteValue(noteValue) || numCells < 1 || numCells > maxPulses)
+                    return nullptr;
+
+                BeatCells beatCells { noteValue, {} };
+
+                for (auto j = 0; j < numCells; ++j)
+                {
+                    auto hit = stream.readBool();
+                    auto accent = jlimit(0.0f, 1.0f, stream.readFloat());
+                    beatCells.cells.push_back({ hit, accent });
+                }
+
+                beats.push_back(std::move(beatCells));
+            }
+
+            auto baseNoteValue = NoteValue::quarter;
+            std::vector<Group> groups;
+
+            if (hasMetre)
+            {
+                baseNoteValue = static_cast<NoteValue>(stream.readByte());
+                auto numGroups = stream.readCompressedInt();
+
+                if (!isValidBaseNoteValue(baseNoteValue) || numGroups < 0 || numGroups > numBeats)
+                    return nullptr;
+
+                for (auto i = 0; i < numGroups; ++i)
+                {
+                    auto groupBeats = stream.readCompressedInt();
+                    groups.push_back({ groupBeats, jlimit(0.0f, 1.0f, stream.readFloat()) });
+                }
+            }
+
+            return new Pattern(name, std::move(beats), baseNoteValue, std::move(groups));
+        }
+
+        static bool isValidNoteValue(NoteValue noteValue)
+        {
+            switch (noteValue)
+            {
+                case NoteValue::whole:
+                case NoteValue::half:
+                case NoteValue::quarter:
+                case NoteValue::eighth:
+                case NoteValue::triplet:
+                case NoteValue::sixteenth:
+                    return true;
+            }
+
+            return false;
+        }
 
-        PulseIterator(std::list<Beat>::iterator bp, Beat::iterator pp) : beatPos(bp), pulsePos(pp) {}
+        // the note value of a beat, which every note value of its pulses is a multiple of
+        static bool isValidBaseNoteValue(NoteValue noteValue)
+        {
+            return noteValue == NoteValue::quarter || noteValue == NoteValue::eighth || noteValue == NoteValue::sixteenth;
+        }
+
+        const String name;
 
-        Pulse& operator*() const { return **pulsePos; }
+        static constexpr int maxBeats = 256;
+        static constexpr int maxPulses = 64;
 
-        PulseIterator& operator++()
+    private:
+        // the accents of the groups are folded into the steps, so they cost the audio thread nothing;
+        // groups that do not add up to the bar are dropped
+        void applyGroups()
         {
-            if (doesPulseIteratorLock.exchange(true, std::memory_order_release) == false
-                && doesNoteButtonLock.load(std::memory_order_acquire) == false)
+            auto numGroupedBeats = 0;
+            auto isEmpty = [](const Group& group) { return group.numBeats < 1; };
+
+            for (auto& group : groups)
+                numGroupedBeats += group.numBeats;
+
+            if (numGroupedBeats != (int) beats.size() || std::any_of(groups.begin(), groups.end(), isEmpty))
+            {
+                groups.clear();
+                return;
+            }
+
+            auto beat = 0;
+
+            for (auto& group : groups)
             {
-                // data race when beatEnd is before pulsePos.
-                // At that moment, pulsePos will access wrong memory location.
-                auto beatEnd = (*beatPos).begin() + (int) (*pulsePos)->noteValue / (int) Metre::baseNoteValue;
+                auto& step = steps[(size_t) beatStarts[(size_t) beat]];
+                step.accent = jmax(step.accent, group.accent);
 
-                ++pulsePos;
+                // the count starts over with every group, as in "1 2, 1 2, 1 2 3"
+                for (auto i = beatStarts[(size_t) beat]; i < (int) steps.size() && steps[(size_t) i].beat < beat + group.numBeats; ++i)
+                    steps[(size_t) i].count = steps[(size_t) i].beat - beat;
 
-                if (pulsePos >= beatEnd)
+                beat += group.numBeats;
+            }
+        }
+
+        // the groove is baked into the steps here, so the audio thread plays it at no extra cost
+        void applyGroove(const Groove& groove)
+        {
+            std::vector<double> onsets;
+
+            for (auto beat = 0; beat < (int) beatStarts.size(); ++beat)
+            {
+                auto firstStep = beatStarts[(size_t) beat];
+                auto numPulses = (beat + 1 < (int) beatStarts.size() ? beatStarts[(size_t) beat + 1] : (int) steps.size()) - firstStep;
+
+                for (auto i = 0; i < numPulses; ++i)
                 {
-                    ++beatPos;
-                    pulsePos = (*beatPos).begin();
+                    auto& step = steps[(size_t) (firstStep + i)];
+                    onsets.push_back(step.position + groove.getOffset(i, numPulses) * step.length);
                 }
             }
 
-            doesPulseIteratorLock.store(false, std::memory_order_release);
+            // the bar is measured from its first onset, so a template may move that one as well
+            for (size_t i = 0; i < steps.size(); ++i)
+            {
+                auto nextOnset = i + 1 < steps.size() ? onsets[i + 1] : length + onsets[0];
+
+                steps[i].length = nextOnset - onsets[i];
+                steps[i].position = onsets[i] - onsets[0];
+            }
+        }
+
+        const std::vector<BeatCells> beats;
+        const NoteValue baseNoteValue;
+        std::vector<Group> groups;
+
+        std::vector<Step> steps;
+        std::vector<int> beatStarts;
+        double length = 0.0;
+
+        JUCE_DECLARE_NON_COPYABLE(Pattern)
+    };
 
-            return *this;
+    class PresetBank
+    {
+    public:
+        PresetBank()
+        {
+            presets.add(makePreset("Quarter", NoteValue::quarter, { 0 }));
+            presets.add(makePreset("Eighth", NoteValue::eighth, { 0 }));
+            presets.add(makePreset("Triplet", NoteValue::triplet, { 0 }));
+            presets.add(makePreset("Sixteenth", NoteValue::sixteenth, { 0 }));
+            presets.add(makePreset("Backbeat", NoteValue::quarter, { 1, 3 }));
+            presets.add(makeAdditivePreset("Seven Eight", NoteValue::eighth, { 2, 2, 3 }));
+            presets.add(makeAdditivePreset("Five Four", NoteValue::quarter, { 3, 2 }));
         }
 
-        bool operator==(const PulseIterator& other) const
+        int size() const { return presets.size(); }
+
+        Pattern::Ptr getPreset(int index) const { return presets[index]; }
+
+        void storePreset(int index, Pattern::Ptr pattern)
         {
-            return beatPos == other.beatPos && pulsePos == other.pulsePos;
+            if (isPositiveAndBelow(index, presets.size()))
+                presets.set(index, pattern.get());
+            else
+                presets.add(pattern);
         }
 
-        bool operator!=(const PulseIterator& other) const
+        void writeTo(OutputStream& stream) const
         {
-            return !(*this == other);
+            stream.writeCompressedInt(presets.size());
+
+            for (auto* preset : presets)
+            {
+                stream.writeString(preset->name);
+                preset->writeTo(stream);
+            }
         }
 
-        inline static std::atomic<bool> doesPulseIteratorLock { false };
-        inline static std::atomic<bool> doesNoteButtonLock { false };
+        bool readFrom(InputStream& stream, bool hasMetre)
+        {
+            ReferenceCountedArray<Pattern> loadedPresets;
+            auto numPresets = stream.readCompressedInt();
+
+            for (auto i = 0; i < numPresets; ++i)
+            {
+                auto name = stream.readString();
+
+                if (auto preset = Pattern::readFrom(stream, name, hasMetre))
+                    loadedPresets.add(preset);
+                else
+                    return false;
+            }
+
+            presets.swapWith(loadedPresets);
+            return true;
+        }
 
     private:
-        std::list<Beat>::iterator beatPos;
-        Beat::iterator pulsePos;
+        static Pattern::Ptr makePreset(const String& name, NoteValue noteValue, std::initializer_list<int> accentedBeats)
+        {
+            std::vector<Pattern::BeatCells> beats;
+
+            for (auto beat = 0; beat < 4; ++beat)
+            {
+                auto isAccented = std::find(accentedBeats.begin(), accentedBeats.end(), beat) != accentedBeats.end();
+                beats.push_back({ noteValue, { { true, isAccented ? 1.0f : 0.0f }, { true, 0.0f }, { true, 0.0f }, { true, 0.0f } } });
+            }
+
+            return new Pattern(name, std::move(beats), NoteValue::quarter);
+        }
+
+        // a beat per base note, grouped and accented as in 2+2+3
+        static Pattern::Ptr makeAdditivePreset(const String& name, NoteValue baseNoteValue, std::initializer_list<int> groupSizes)
+        {
+            std::vector<Pattern::BeatCells> beats;
+            std::vector<Pattern::Group> groups;
+
+            for (auto groupSize : groupSizes)
+            {
+                groups.push_back({ groupSize, groups.empty() ? 1.0f : 0.5f });
+
+                for (auto i = 0; i < groupSize; ++i)
+                    beats.push_back({ baseNoteValue, { { true, 0.0f } } });
+            }
+
+            return new Pattern(name, std::move(beats), baseNoteValue, std::move(groups));
+        }
+
+        ReferenceCountedArray<Pattern> presets;
     };
 
-    class Metre : public Timer
+    class Metre : public Timer, public ChangeBroadcaster
     {
     public:
         Metre()
         {
+            init();
         }
 
-        void setBPM(float bpmToUse)
+        // the limits are for beats of a quarter note, and scale with the note value of the beat,
+        // e.g. a host's 300 quarter-note BPM is 1200 beats of a sixteenth
+        void setBPM(float bpmToUse, NoteValue beatNoteValue = NoteValue::quarter)
         {
-            if (bpmToUse < 20.0f)
-                BPM = 20.0f;
-            else if (bpmToUse > 999.0f)
-                BPM = 999.0f;
+            auto scale = (float) beatNoteValue / 4.0f;
+
+            if (bpmToUse < 20.0f * scale)
+                BPM = 20.0f * scale;
+            else if (bpmToUse > 999.0f * scale)
+                BPM = 999.0f * scale;
             else
                 BPM = bpmToUse;
         }
 
-        float getBPM()
+        float getBPM() const
         {
             return BPM;
         }
 
-        static float getIntervalPerBeat()
+        float getIntervalPerBeat() const
         {
             return 60.0f / BPM;
         }
 
-        static double getSampleRatePerBeat()
+        double getSampleRatePerBeat() const
         {
             return audioDeviceSampleRate * getIntervalPerBeat();
         }
@@ -176,106 +491,511 @@ public:
 
         void init()
         {
-            float note4th = convertToSampleLength(NoteValue::quarter);
+            jassert(beatList.empty());
 
-            beatList.push_back(Beat {});
-            beatList.push_back(Beat {});
-            beatList.push_back(Beat {});
-            beatList.push_back(Beat {});
-            beatList.push_back(Beat {}); // not used
+            applyTimeSignature(4, NoteValue::quarter, {});
 
-            auto last = --beatList.end();
+            playingPattern = createPattern();
+            patternPool.add(playingPattern);
+        }
 
-            for (auto it = beatList.begin(); it != last; ++it)
-            {
-                it->push_back(std::make_unique<Pulse>(true, 0.0f, NoteValue::quarter, note4th, *it));
-                it->push_back(std::make_unique<Pulse>(true, 0.0f, NoteValue::quarter, note4th, *it));
-                it->push_back(std::make_unique<Pulse>(true, 0.0f, NoteValue::quarter, note4th, *it));
-                it->push_back(std::make_unique<Pulse>(true, 0.0f, NoteValue::quarter, note4th, *it));
-            }
+        void prepareToPlay(double sampleRate)
+        {
+            auto ratio = sampleRate / audioDeviceSampleRate;
+            audioDeviceSampleRate = sampleRate;
 
-            currentPulse = begin();
+            // rescale in place, so the pattern and the play position survive a device restart
+            sampleLength = getSampleLength(playingPattern->getSteps()[(size_t) stepIndex]);
+            index = jmin((int) (index * ratio), (int) sampleLength);
         }
 
         void update()
         {
-            for (auto& pulse : *this)
             {
-                pulse.index = 0;
-                pulse.sampleLength = convertToSampleLength(pulse.noteValue);
+                const SpinLock::ScopedLockType lock(patternLock);
+
+                if (pendingPattern != nullptr)
+                {
+                    playingPattern = pendingPattern;
+                    pendingPattern = nullptr;
+                }
             }
 
-            currentPulse = begin();
+            stepIndex = 0;
+            index = 0;
+            sampleLength = getSampleLength(playingPattern->getSteps()[0]);
 
             tailOff = 1.0f;
         }
 
-        static float convertToSampleLength(NoteValue noteValue)
+        //==============================================================================
+        // message thread only
+
+        Pattern::Ptr createPattern(const String& name = {})
+        {
+            std::vector<Pattern::BeatCells> beats;
+
+            for (auto& beat : beatList)
+            {
+                if ((int) beats.size() == beatsPerBar)
+                    break;
+
+                Pattern::BeatCells beatCells { beat[0]->noteValue, {} };
+
+                for (auto& pulse : beat)
+                    beatCells.cells.push_back({ pulse->getHit(), pulse->getAccent() });
+
+                beats.push_back(std::move(beatCells));
+            }
+
+            return new Pattern(name, std::move(beats), baseNoteValue, groups);
+        }
+
+        void loadPattern(const Pattern& pattern)
+        {
+            applyTimeSignature((int) pattern.getBeats().size(), pattern.getBaseNoteValue(), pattern.getGroups());
+
+            auto it = beatList.begin();
+
+            for (auto& beatCells : pattern.getBeats())
+            {
+                if (it == beatList.end())
+                    break;
+
+                (*it)[0]->setNoteValue(beatCells.noteValue);
+
+                for (size_t i = 0; i < it->size() && i < beatCells.cells.size(); ++i)
+                {
+                    (*it)[i]->setHit(beatCells.cells[i].hit);
+                    (*it)[i]->setAccent(beatCells.cells[i].accent);
+                }
+
+                ++it;
+            }
+
+            sendChangeMessage();
+        }
+
+        // an edit is picked up at the next beat
+        void commitPattern()
         {
-            return getSampleRatePerBeat() * (float) baseNoteValue / (float) noteValue;
+            publishPattern(createPattern(), false);
         }
 
-        PulseIterator begin()
+        // replace the pattern as a whole, at the next beat or the next bar
+        void setPattern(Pattern::Ptr pattern, bool atNextBar)
         {
-            return PulseIterator(beatList.begin(), (*beatList.begin()).begin());
+            loadPattern(*pattern);
+            publishPattern(pattern, atNextBar);
         }
 
-        PulseIterator end()
+        // "4/4", "6/8 3+3", "7/8 2+2+3" and the like, heard from the next bar; the first group is
+        // accented fully and the others by half. Returns false if the text is no time signature.
+        bool setTimeSignature(const String& text)
         {
-            auto last = beatList.end();
-            --last;
-            return PulseIterator(last, (*last).end());
+            auto tokens = StringArray::fromTokens(text, " ", "");
+            tokens.removeEmptyStrings();
+
+            auto numBeats = tokens[0].upToFirstOccurrenceOf("/", false, false).getIntValue();
+            auto denominator = static_cast<NoteValue>(tokens[0].fromFirstOccurrenceOf("/", false, false).getIntValue());
+
+            if (!tokens[0].containsChar('/') || numBeats < 1 || numBeats > maxBeatsPerBar
+                || !Pattern::isValidBaseNoteValue(denominator) || tokens.size() > 2)
+                return false;
+
+            std::vector<Pattern::Group> groupsToUse;
+            auto numGroupedBeats = 0;
+
+            for (auto& size : tokens.size() == 2 ? StringArray::fromTokens(tokens[1], "+", "") : StringArray())
+            {
+                if (size.getIntValue() < 1)
+                    return false;
+
+                groupsToUse.push_back({ size.getIntValue(), groupsToUse.empty() ? 1.0f : 0.5f });
+                numGroupedBeats += size.getIntValue();
+            }
+
+            if (!groupsToUse.empty() && numGroupedBeats != numBeats)
+                return false;
+
+            applyTimeSignature(numBeats, denominator, std::move(groupsToUse));
+            sendChangeMessage();
+
+            publishPattern(createPattern(), true);
+            return true;
         }
 
-        float getPulseSample(AudioProcessor& audioProcessor)
+        String getTimeSignature() const
         {
-            if (currentPulse == end())
-                return 0.0f;
+            auto text = String(beatsPerBar) + "/" + String((int) baseNoteValue);
 
-            if ((*currentPulse).index < (*currentPulse).sampleLength)
+            if (!groups.empty())
             {
-                float pulseSample = 1.0f;
+                StringArray sizes;
 
-                if ((*currentPulse).hit && tailOff > 0.001f)
-                {
-                    if ((*currentPulse).index > 2048)
-                    {
-                        pulseSample *= tailOff;
-                        tailOff *= 0.99f;
-                    }
-                }
-                else
-                {
-                    pulseSample = 0.0f;
-                }
+                for (auto& group : groups)
+                    sizes.add(String(group.numBeats));
+
+                text << " " << sizes.joinIntoString("+");
+            }
+
+            return text;
+        }
+
+        int getBeatsPerBar() const { return beatsPerBar; }
+
+        // the groove is heard from the next bar, so a bar is never half swung
+        void setGroove(const Groove& grooveToUse)
+        {
+            groove = grooveToUse;
+            publishPattern(createPattern(), true);
+        }
 
-                ++(*currentPulse).index;
-                return pulseSample;
+        const Groove& getGroove() const { return groove; }
+
+        // a preset is already compiled, so recalling it only swaps a pointer at the next bar
+        void recallPreset(int presetIndex)
+        {
+            if (auto preset = presetBank.getPreset(presetIndex))
+            {
+                currentPreset = presetIndex;
+                setPattern(preset, true);
             }
+        }
 
-            (*currentPulse).index = 0; // reset
+        void storePreset(int presetIndex, const String& name)
+        {
+            presetBank.storePreset(presetIndex, createPattern(name));
+        }
+
+        int getCurrentPreset() const { return currentPreset; }
+
+        void writeState(OutputStream& stream)
+        {
+            createPattern()->writeTo(stream);
+        }
+
+        bool readState(InputStream& stream, bool hasMetre)
+        {
+            if (auto pattern = Pattern::readFrom(stream, {}, hasMetre))
+            {
+                setPattern(pattern, false);
+                return true;
+            }
+
+            return false;
+        }
+
+        float getSampleLength(const Pattern::Step& step) const
+        {
+            return getSampleLength(step, BPM, audioDeviceSampleRate);
+        }
+
+        //==============================================================================
+        // audio thread
+
+        struct PulseEvent
+        {
+            int samplePosition;
+            int step;
+            int beat;
+            bool isBeatStart;
+            bool hit;
+            float accent;
+        };
+
+        static constexpr int maxEventsPerBlock = 128;
+
+        // the onsets of the next block are collected while the sound processor pulls samples
+        void beginBlock()
+        {
+            blockSamplePosition = 0;
+            numEvents = 0;
+        }
+
+        const PulseEvent* getEvents() const { return events.data(); }
+        int getNumEvents() const { return numEvents; }
+
+        float getPulseSample(AudioProcessor& audioProcessor)
+        {
+            if (index < sampleLength)
+            {
+                if (index == 0)
+                    addEvent();
+
+                ++blockSamplePosition;
+
+                return getEnvelope(getCurrentStep().hit, index++, tailOff);
+            }
+
+            index = 0; // reset
             audioProcessor.reset();
             tailOff = 1.0f;
-            ++currentPulse;
 
-            if (currentPulse == end())
-                currentPulse = begin();
+            advance();
 
             return getPulseSample(audioProcessor);
         }
 
-        inline static double audioDeviceSampleRate { 44100.0 };
+        // Moves on by a block without pulling samples, for a sound that is rendered already. The
+        // onsets are collected as getPulseSample collects them, and the function is called once per
+        // stretch of a pulse as (stepIndex, sampleInPulse, sampleInBlock, numSamples).
+        template <typename Function>
+        void advanceBlock(int numSamples, Function&& renderStretch)
+        {
+            while (numSamples > 0)
+            {
+                if (index >= sampleLength)
+                {
+                    index = 0;
+                    tailOff = 1.0f;
+                    advance();
+                }
+
+                if (index == 0)
+                    addEvent();
+
+                auto stretch = jmin(numSamples, (int) std::ceil(sampleLength) - index);
+                renderStretch(stepIndex, index, blockSamplePosition, stretch);
+
+                // the tail as getPulseSample would have left it, should the next block be pulled
+                auto numFading = jmin(stretch, index + stretch - (tailStart + 1));
+
+                if (getCurrentStep().hit && tailOff > 0.001f && numFading > 0)
+                    tailOff *= std::pow(0.99f, (float) numFading);
+
+                index += stretch;
+                blockSamplePosition += stretch;
+                numSamples -= stretch;
+            }
+        }
+
+        // the shape of a click: full for the first samples of a pulse, then a quick fade
+        static float getEnvelope(bool hit, int sampleInPulse, float& tailOff)
+        {
+            if (!hit || tailOff <= 0.001f)
+                return 0.0f;
+
+            if (sampleInPulse <= tailStart)
+                return 1.0f;
+
+            auto envelope = tailOff;
+            tailOff *= 0.99f;
+            return envelope;
+        }
+
+        // the same length as the pulse of the step is played with at this tempo and rate
+        static float getSampleLength(const Pattern::Step& step, float bpm, double sampleRate)
+        {
+            return (float) (sampleRate * (60.0f / bpm) * step.length);
+        }
+
+        // any thread; holding it keeps the pattern alive while it is read elsewhere
+        Pattern::Ptr getPlayingPattern()
+        {
+            const SpinLock::ScopedLockType lock(patternLock);
+            return playingPattern;
+        }
+
+        const Pattern* getPlayingPatternPointer() const { return playingPattern.get(); }
+        int getCurrentStepIndex() const { return stepIndex; }
+        int getSampleInPulse() const { return index; }
+        int getPulseLength() const { return (int) std::ceil(sampleLength); }
+
+        const Pattern::Step& getCurrentStep() const { return playingPattern->getSteps()[(size_t) stepIndex]; }
+        float getCurrentAccent() const { return getCurrentStep().accent; }
+        int getNumBeats() const { return (int) playingPattern->getBeats().size(); }
+        double getLength() const { return playingPattern->getLength(); }
+        NoteValue getPlayingBaseNoteValue() const { return playingPattern->getBaseNoteValue(); }
+
+        // the play position in beats from the start of the bar
+        double getPosition() const
+        {
+            return getCurrentStep().position + index / getSampleRatePerBeat();
+        }
+
+        // jump to a position in beats from the start of the bar, e.g. to follow a host transport;
+        // an onset is only played if the position lands exactly on it
+        void setPosition(double beatPosition)
+        {
+            auto& steps = playingPattern->getSteps();
+            beatPosition -= getLength() * std::floor(beatPosition / getLength());
+
+            auto isAfter = [](double position, const Pattern::Step& step) { return position < step.position; };
+            auto next = std::upper_bound(steps.begin(), steps.end(), beatPosition, isAfter);
+
+            stepIndex = jmax(0, (int) std::distance(steps.begin(), next) - 1);
+            sampleLength = getSampleLength(getCurrentStep());
+            index = jlimit(0, (int) sampleLength - 1, (int) ((beatPosition - getCurrentStep().position) * getSampleRatePerBeat()));
+
+            tailOff = 1.0f;
+        }
+
+        // lengthen or shorten the current pulse, by at most a quarter of it, to follow another clock
+        void nudgeCurrentPulse(float samples)
+        {
+            auto limit = 0.25f * getSampleLength(getCurrentStep());
+            sampleLength = jmax((float) index + 1.0f, sampleLength + jlimit(-limit, limit, samples));
+        }
+
+        PresetBank presetBank;
 
         std::list<Beat> beatList;
-        PulseIterator currentPulse;
 
-        inline static NoteValue baseNoteValue = NoteValue::quarter;
+        double audioDeviceSampleRate = 44100.0;
+
+        // the editor's metre, message thread only; the audio thread plays the one of its pattern
+        NoteValue baseNoteValue = NoteValue::quarter;
+
+        // a whole song map fits, e.g. 64 bars of 4/4 as "256/4"; the editor only builds the rows in view
+        static constexpr int maxBeatsPerBar = Pattern::maxBeats;
+
+        static constexpr int tailStart = 2048;
 
     private:
-        inline static float BPM { 120.0f };
+        // the beats beyond the bar are kept, so the editor never points at a deleted beat
+        void applyTimeSignature(int numBeats, NoteValue baseNoteValueToUse, std::vector<Pattern::Group> groupsToUse)
+        {
+            while ((int) beatList.size() < numBeats)
+            {
+                auto& beat = *beatList.insert(beatList.end(), Beat {});
+
+                for (auto i = 0; i < 4; ++i)
+                    beat.push_back(std::make_unique<Pulse>(true, 0.0f, baseNoteValueToUse, beat));
+            }
+
+            // pulses that do not divide the new beat start over as one pulse per beat
+            for (auto& beat : beatList)
+                if ((int) beat[0]->noteValue % (int) baseNoteValueToUse != 0)
+                    beat[0]->setNoteValue(baseNoteValueToUse);
+
+            beatsPerBar = numBeats;
+            baseNoteValue = baseNoteValueToUse;
+            groups = std::move(groupsToUse);
+        }
+
+        void addEvent()
+        {
+            if (numEvents >= maxEventsPerBlock)
+                return;
+
+            auto& step = getCurrentStep();
+            TraceRecorder::instant(step.hit ? "Pulse Onset" : "Rest Onset", stepIndex);
+
+            events[(size_t) numEvents++] = { blockSamplePosition,
+                                             stepIndex,
+                                             step.beat,
+                                             playingPattern->getFirstStepOfBeat(step.beat) == stepIndex,
+                                             step.hit,
+                                             step.accent };
+        }
+
+        void advance()
+        {
+            auto& steps = playingPattern->getSteps();
+            auto nextStepIndex = stepIndex + 1;
+            auto isBarEnd = nextStepIndex >= (int) steps.size();
+            auto isBeatEnd = isBarEnd || steps[(size_t) nextStepIndex].beat != steps[(size_t) stepIndex].beat;
+
+            stepIndex = isBarEnd ? 0 : nextStepIndex;
+
+            if (isBeatEnd)
+                adoptPendingPattern(isBarEnd);
+
+            // a tempo change takes effect on the next pulse
+            sampleLength = getSampleLength(getCurrentStep());
+        }
+
+        void adoptPendingPattern(bool isBarEnd)
+        {
+            const SpinLock::ScopedTryLockType lock(patternLock);
+
+            if (!lock.isLocked() || pendingPattern == nullptr || (pendingAtNextBar && !isBarEnd))
+                return;
+
+            auto beat = getCurrentStep().beat;
+
+            // patternPool still holds the old pattern, so it is never freed here
+            playingPattern = pendingPattern;
+            pendingPattern = nullptr;
+
+            stepIndex = playingPattern->getFirstStepOfBeat(beat);
+            TraceRecorder::instant("Pattern Adopted", stepIndex);
+        }
+
+        void publishPattern(Pattern::Ptr pattern, bool atNextBar)
+        {
+            const TraceRecorder::ScopedEvent traceEvent("Pattern Edit", (int64) pattern->getSteps().size());
+
+            // the audio thread always plays a step, so a pattern without one never reaches it
+            if (pattern->getSteps().empty())
+            {
+                jassertfalse;
+                return;
+            }
+
+            // presets and saved patterns are straight, the audio thread gets them with the groove
+            if (!groove.offsets.empty())
+                pattern = new Pattern(pattern->name, pattern->getBeats(), pattern->getBaseNoteValue(), pattern->getGroups(), groove);
+
+            patternPool.addIfNotAlreadyThere(pattern.get());
+
+            {
+                const SpinLock::ScopedLockType lock(patternLock);
+                pendingPattern = pattern;
+                pendingAtNextBar = atNextBar;
+            }
+
+            // free the snapshots that neither the audio thread nor the preset bank can reach
+            for (auto i = patternPool.size(); --i >= 0;)
+                if (patternPool.getObjectPointerUnchecked(i)->getReferenceCount() == 1)
+                    patternPool.remove(i);
+        }
+
+        std::atomic<float> BPM { 120.0f };
         std::vector<double> tapTimes;
 
+        Groove groove;
+        int beatsPerBar = 0;
+        std::vector<Pattern::Group> groups;
+
+        ReferenceCountedArray<Pattern> patternPool;
+        SpinLock patternLock;
+        Pattern::Ptr playingPattern, pendingPattern;
+        bool pendingAtNextBar = false;
+
+        int stepIndex = 0;
+        int index = 0;
+        float sampleLength = 0.0f;
         float tailOff = 1.0f;
+
+        std::array<PulseEvent, maxEventsPerBlock> events;
+        int numEvents = 0;
+        int blockSamplePosition = 0;
+
+        int currentPreset = 0;
+    };
+
+    // Something the Metre can be phase-locked to, e.g. an external MIDI clock or another instance.
+    class ClockFollower
+    {
+    public:
+        virtual ~ClockFollower() = default;
+
+        virtual bool isLocked() const = 0;
+        virtual float getTempo() const = 0;
+
+        // how far the onset of a beat at the given time (Time::getMillisecondCounterHiRes) lies
+        // from the master's, in milliseconds; a master without bars takes its nearest beat
+        virtual double getPhaseError(double onsetTime, int beat) const = 0;
+
+        // the master's position in beats from the start of its bar at the given time, for a master
+        // that knows its bars, so a follower can join it on the same beat
+        virtual bool getBarPosition(double /*time*/, double& /*beatPosition*/) const { return false; }
+
+        // audio thread; the note value a beat of the follower counts, for a master that counts
+        // quarter notes whatever the metre
+        virtual void setBaseNoteValue(NoteValue) {}
     };
 
 private:
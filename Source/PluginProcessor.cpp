@@ -0,0 +1,6 @@
+#include "PluginProcessor.h"
+
+AudioProcessor* JUCE_CALLTYPE createPluginFilter()
+{
+    return new ChronometroPluginProcessor();
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "MidiSync.h"
+#include "Music.h"
+#include "SoundStall.h"
+
+// the Metre has to exist before the SoundStallProcessor base that plays it
+struct PluginMetre
+{
+    Music::Metre metre;
+};
+
+// The engine as a plugin. The host transport drives the Metre, the clicks are rendered straight
+// into the host's buffer and the onsets go out as MIDI, all at the host's sample positions.
+class ChronometroPluginProcessor : private PluginMetre, public SoundStallProcessor
+{
+public:
+    ChronometroPluginProcessor() : SoundStallProcessor(metre) {}
+
+    void prepareToPlay(double sampleRate, int samplesPerBlock) override
+    {
+        metre.prepareToPlay(sampleRate);
+
+        SoundStallProcessor::prepareToPlay(sampleRate, samplesPerBlock);
+
+        segmentMidiBuffer.ensureSize(4096);
+        wasPlaying = false;
+    }
+
+    void processBlock(AudioSampleBuffer& buffer, MidiBuffer& midiMessages) override
+    {
+        ScopedNoDenormals noDenormals;
+
+        AudioPlayHead::CurrentPositionInfo position;
+        auto* playHead = getPlayHead();
+
+        if (playHead == nullptr || !playHead->getCurrentPosition(position))
+            position.resetToDefault();
+
+        midiMessages.clear();
+
+        if (!position.isPlaying)
+        {
+            buffer.clear();
+
+            if (wasPlaying)
+            {
+                midiClock.stop(midiMessages);
+                SoundStallProcessor::reset();
+                wasPlaying = false;
+            }
+
+            return;
+        }
+
+        auto baseNoteValue = (double) metre.getPlayingBaseNoteValue();
+
+        // the host's tempo wins over the tempo parameter while it plays; it counts quarter notes,
+        // the Metre beats of the base note
+        if (position.bpm > 0.0)
+            metre.setBPM((float) (position.bpm * baseNoteValue / 4.0), metre.getPlayingBaseNoteValue());
+        auto quartersToBeats = baseNoteValue / 4.0;
+        auto barLength = position.timeSigNumerator * baseNoteValue / jmax(1, position.timeSigDenominator);
+        auto barPosition = (position.ppqPosition - position.ppqPositionOfLastBarStart) * quartersToBeats;
+
+        if (barLength > 0.0)
+            barPosition -= barLength * std::floor(barPosition / barLength);
+
+        if (!wasPlaying)
+        {
+            metre.update();
+            metre.setPosition(barPosition);
+            midiClock.start(midiMessages);
+            wasPlaying = true;
+        }
+        else
+        {
+            // a loop, a jump or tempo automation; a small drift is left alone so no onset is cut
+            followHost(barPosition);
+        }
+
+        // the pattern restarts on every bar line of the host, even when its length differs
+        auto numSamples = buffer.getNumSamples();
+        auto samplesToBarLine = barLength > 0.0 ? (barLength - barPosition) * metre.getSampleRatePerBeat() : (double) numSamples;
+        auto barLineSample = jlimit(0, numSamples, roundToInt(samplesToBarLine));
+
+        if (barLineSample > 0)
+            renderSegment(buffer, midiMessages, 0, barLineSample);
+
+        if (barLineSample < numSamples)
+        {
+            followHost(0.0);
+            renderSegment(buffer, midiMessages, barLineSample, numSamples - barLineSample);
+        }
+    }
+
+    const String getName() const override { return JucePlugin_Name; }
+    bool acceptsMidi() const override { return false; }
+    bool producesMidi() const override { return true; }
+
+    bool isBusesLayoutSupported(const BusesLayout& layouts) const override
+    {
+        // the sound stall renders a stereo pair
+        return layouts.getMainInputChannelSet() == AudioChannelSet::stereo()
+            && layouts.getMainOutputChannelSet() == AudioChannelSet::stereo();
+    }
+
+private:
+    void followHost(double barPosition)
+    {
+        auto error = std::remainder(metre.getPosition() - barPosition, metre.getLength());
+
+        if (std::abs(error) * metre.getSampleRatePerBeat() > resyncToleranceSeconds * getSampleRate())
+            metre.setPosition(barPosition);
+    }
+
+    void renderSegment(AudioSampleBuffer& buffer, MidiBuffer& midiMessages, int startSample, int numSamples)
+    {
+        AudioSampleBuffer segment { buffer.getArrayOfWritePointers(), buffer.getNumChannels(), startSample, numSamples };
+
+        segmentMidiBuffer.clear();
+        SoundStallProcessor::processBlock(segment, segmentMidiBuffer);
+
+        segmentMidiBuffer.clear();
+        midiClock.process(segmentMidiBuffer, metre, numSamples, getSampleRate());
+        midiMessages.addEvents(segmentMidiBuffer, 0, numSamples, startSample);
+    }
+
+    static constexpr double resyncToleranceSeconds = 0.002;
+
+    MidiBuffer segmentMidiBuffer;
+    MidiClockGenerator midiClock;
+
+    bool wasPlaying = false;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ChronometroPluginProcessor)
+};
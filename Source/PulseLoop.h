@@ -0,0 +1,276 @@
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "Music.h"
+#include "SampleTable.h"
+
+// A whole bar of the pulse sound, rendered ahead on a background thread, so a pattern that repeats
+// is played by copying rather than by working out every sample again. A loop is made for one
+// pattern, tempo, sample table and voicing; the audio thread plays it only while all of them are
+// still the ones it would play live, and since the loop holds exactly the samples the live sound
+// would make, it can switch between the two at any sample without a seam.
+class PulseLoop : private Thread
+{
+public:
+    // what decides the sound of each pulse besides the pattern
+    struct Voicing
+    {
+        // the choices of the beat, downbeat, accent and subdivision sounds
+        std::array<int, 4> sounds {};
+        float subdivisionGain = 1.0f;
+        float accentDepth = 0.0f;
+
+        bool operator==(const Voicing& other) const
+        {
+            return sounds == other.sounds && subdivisionGain == other.subdivisionGain && accentDepth == other.accentDepth;
+        }
+    };
+
+    enum
+    {
+        beatCategory,
+        downbeatCategory,
+        accentCategory,
+        subdivisionCategory
+    };
+
+    // the stretch of the sample table a pulse plays, and how it is shaped
+    struct PulseSound
+    {
+        int start = 0, end = 0;
+        float gain = 1.0f;
+
+        // the accent saturates the pulse, no accent leaves it clean
+        float drive = 0.0f;
+
+        bool isVoice = false;
+
+        // a voice is faded out over its last samples before the next onset or the end of the word
+        int fadeEnd = 0, fadeLength = 1;
+    };
+
+    static PulseSound getPulseSound(const Music::Pattern::Step& step, Music::NoteValue baseNoteValue,
+                                    const SampleTable::Pool& pool, const Voicing& voicing, int pulseLength)
+    {
+        if (!step.hit)
+            return {};
+
+        auto category = step.beat == 0 && step.pulse == 0 ? downbeatCategory
+                      : step.accent > 0.0f               ? accentCategory
+                      : step.pulse > 0                   ? subdivisionCategory
+                                                         : beatCategory;
+
+        // a category set to "Same" plays the sound of the beat
+        auto choice = category != beatCategory ? voicing.sounds[(size_t) category] : 0;
+        auto sound = static_cast<SampleTable::Sound>(choice > 0 ? choice - 1 : voicing.sounds[beatCategory]);
+
+        auto& sample = pool.entries[(size_t) SampleTable::getEntry(sound, step, baseNoteValue)];
+        auto accent = step.accent * voicing.accentDepth;
+
+        PulseSound pulseSound;
+        pulseSound.start = sample.start;
+        pulseSound.end = sample.start + sample.length;
+        pulseSound.gain = category == subdivisionCategory ? voicing.subdivisionGain : 1.0f;
+        pulseSound.drive = accent > 0.0f ? 1.0f + std::log(10.0f * accent + 1.0f) : 0.0f;
+        pulseSound.isVoice = sound == SampleTable::Sound::voice;
+        pulseSound.fadeEnd = jmin(pulseSound.end, pulseSound.start + pulseLength);
+        pulseSound.fadeLength = jmax(1, (int) (voiceFadeSeconds * pool.sampleRate));
+
+        return pulseSound;
+    }
+
+    // one sample of a pulse, as the live sound and the loop both make it
+    static float renderSample(const SampleTable::Pool& pool, const PulseSound& pulseSound, int sampleIndex, float envelope)
+    {
+        if (sampleIndex >= pulseSound.end)
+            return 0.0f;
+
+        if (pulseSound.isVoice)
+            envelope = jlimit(0.0f, 1.0f, (float) (pulseSound.fadeEnd - sampleIndex) / (float) pulseSound.fadeLength);
+
+        auto sample = pool.samples.getSample(0, sampleIndex) * envelope;
+
+        if (pulseSound.drive > 0.0f)
+            sample = std::tanh(pulseSound.drive * sample);
+
+        return sample * pulseSound.gain;
+    }
+
+    struct Loop : public ReferenceCountedObject
+    {
+        using Ptr = ReferenceCountedObjectPtr<Loop>;
+
+        // audio thread; only the pattern's address is compared, the loop keeps the pattern alive
+        bool matches(const Music::Pattern* playingPattern, float playingBPM, const SampleTable::Pool* playingPool, const Voicing& playingVoicing) const
+        {
+            return pattern.get() == playingPattern && bpm == playingBPM && pool.get() == playingPool && voicing == playingVoicing;
+        }
+
+        Music::Pattern::Ptr pattern;
+        float bpm = 0.0f;
+        SampleTable::Pool::Ptr pool;
+        Voicing voicing;
+
+        // every step has its own stretch of the buffer, as long as its pulse plays at this tempo
+        AudioSampleBuffer samples;
+        std::vector<int> stepStarts, stepLengths;
+    };
+
+    PulseLoop(Music::Metre& metre, SampleTable& table, std::function<Voicing()> getVoicingToUse)
+        : Thread("Pulse Loop"), musicMetre(metre), sampleTable(table), getVoicing(std::move(getVoicingToUse))
+    {
+        startThread(3);
+    }
+
+    ~PulseLoop() override
+    {
+        stopThread(2000);
+    }
+
+    // any thread, including the audio thread through automation; the thread is woken by refresh()
+    void setEnabled(bool shouldBeEnabled) { enabled = shouldBeEnabled; }
+
+    bool isEnabled() const { return enabled.load(std::memory_order_relaxed); }
+
+    // message thread, while the transport plays; wakes the thread when what it would render has
+    // changed since the last wake, e.g. at a start with the loop just switched on, or with a new
+    // pattern, tempo, sample table or voicing
+    void refresh()
+    {
+        SampleTable::Pool::Ptr pool;
+        sampleTable.adoptLatest(pool);
+
+        auto pattern = musicMetre.getPlayingPattern();
+        auto bpm = musicMetre.getBPM();
+        auto voicing = getVoicing();
+
+        if (pattern == requestedPattern && bpm == requestedBPM && pool == requestedPool && voicing == requestedVoicing)
+            return;
+
+        requestedPattern = pattern;
+        requestedBPM = bpm;
+        requestedPool = pool;
+        requestedVoicing = voicing;
+
+        notify();
+    }
+
+    // audio thread; swaps in the latest loop if there is one and the lock is free
+    void adoptLatest(Loop::Ptr& loop)
+    {
+        const SpinLock::ScopedTryLockType lock(loopLock);
+
+        if (lock.isLocked() && latestLoop != nullptr)
+            loop = latestLoop;
+    }
+
+private:
+    void run() override
+    {
+        while (!threadShouldExit())
+        {
+            if (enabled)
+                update();
+
+            wait(-1);
+        }
+    }
+
+    void update()
+    {
+        SampleTable::Pool::Ptr pool;
+        sampleTable.adoptLatest(pool);
+
+        auto pattern = musicMetre.getPlayingPattern();
+        auto bpm = musicMetre.getBPM();
+        auto voicing = getVoicing();
+
+        if (pool == nullptr || pattern == nullptr || (latestLoop != nullptr && latestLoop->matches(pattern.get(), bpm, pool.get(), voicing)))
+            return;
+
+        if (auto loop = createLoop(pattern, bpm, pool, voicing))
+            if (!threadShouldExit())
+                publish(loop);
+    }
+
+    Loop::Ptr createLoop(Music::Pattern::Ptr pattern, float bpm, SampleTable::Pool::Ptr pool, const Voicing& voicing)
+    {
+        const TraceRecorder::ScopedEvent traceEvent("Loop Render", (int64) pattern->getSteps().size());
+
+        Loop::Ptr loop = new Loop();
+        loop->pattern = pattern;
+        loop->bpm = bpm;
+        loop->pool = pool;
+        loop->voicing = voicing;
+
+        auto totalLength = 0;
+
+        for (auto& step : pattern->getSteps())
+        {
+            auto length = (int) std::ceil(Music::Metre::getSampleLength(step, bpm, pool->sampleRate));
+            loop->stepStarts.push_back(totalLength);
+            loop->stepLengths.push_back(length);
+            totalLength += length;
+        }
+
+        // a long song map at a slow tempo is left to the live sound
+        if (totalLength <= 0 || totalLength > (int) (maxLoopSeconds * pool->sampleRate))
+            return nullptr;
+
+        loop->samples.setSize(1, totalLength);
+        auto* loopBuffer = loop->samples.getWritePointer(0);
+
+        auto& steps = pattern->getSteps();
+
+        for (size_t i = 0; i < steps.size() && !threadShouldExit(); ++i)
+        {
+            auto pulseSound = getPulseSound(steps[i], pattern->getBaseNoteValue(), *pool, voicing, loop->stepLengths[i]);
+            auto* stepBuffer = loopBuffer + loop->stepStarts[i];
+            auto tailOff = 1.0f;
+
+            for (auto n = 0; n < loop->stepLengths[i]; ++n)
+            {
+                auto envelope = Music::Metre::getEnvelope(steps[i].hit, n, tailOff);
+                stepBuffer[n] = renderSample(*pool, pulseSound, pulseSound.start + n, envelope);
+            }
+        }
+
+        return loop;
+    }
+
+    // the audio thread may still play an older loop, so the loops are only freed here
+    void publish(Loop::Ptr loop)
+    {
+        loops.add(loop);
+
+        {
+            const SpinLock::ScopedLockType lock(loopLock);
+            latestLoop = loop;
+        }
+
+        for (auto i = loops.size(); --i >= 0;)
+            if (loops.getObjectPointerUnchecked(i)->getReferenceCount() == 1)
+                loops.remove(i);
+    }
+
+    static constexpr double maxLoopSeconds = 30.0;
+    static constexpr double voiceFadeSeconds = 0.003;
+
+    Music::Metre& musicMetre;
+    SampleTable& sampleTable;
+    const std::function<Voicing()> getVoicing;
+
+    std::atomic<bool> enabled { false };
+
+    // message thread; what the thread was last woken for
+    Music::Pattern::Ptr requestedPattern;
+    float requestedBPM = 0.0f;
+    SampleTable::Pool::Ptr requestedPool;
+    Voicing requestedVoicing;
+
+    ReferenceCountedArray<Loop> loops;
+    SpinLock loopLock;
+    Loop::Ptr latestLoop;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(PulseLoop)
+};
@@ -0,0 +1,207 @@
+#include "RealtimeCheck.h"
+
+#if CHRONOMETRO_RT_CHECK
+
+ #if !JUCE_LINUX
+  #error "the real-time checker replaces glibc's allocator and pthread symbols, so it needs Linux"
+ #endif
+
+ #include <cerrno>
+ #include <dlfcn.h>
+ #include <execinfo.h>
+ #include <pthread.h>
+ #include <time.h>
+ #include <unistd.h>
+
+namespace RealtimeCheck
+{
+    namespace
+    {
+        struct Record
+        {
+            Violation violation;
+            void* frames[32];
+            int numFrames;
+        };
+
+        constexpr int maxRecords = 64;
+
+        std::array<Record, maxRecords> records;
+        std::atomic<int> numViolations { 0 };
+
+        thread_local int callbackDepth = 0;
+        thread_local bool isRecording = false;
+
+        // no allocation, no lock: a slot is claimed by the counter, and the trace comes from the
+        // stack walker that was loaded before the first callback
+        void record(Violation violation)
+        {
+            if (callbackDepth == 0 || isRecording)
+                return;
+
+            isRecording = true;
+
+            auto index = numViolations.fetch_add(1);
+
+            if (index < maxRecords)
+            {
+                auto& slot = records[(size_t) index];
+                slot.violation = violation;
+                slot.numFrames = backtrace(slot.frames, numElementsInArray(slot.frames));
+            }
+
+            isRecording = false;
+        }
+
+        // resolved on first use, as the hooks may run before any static initialiser
+        template <typename Function>
+        Function* findNext(Function*& next, const char* name)
+        {
+            if (next == nullptr)
+                next = reinterpret_cast<Function*>(dlsym(RTLD_NEXT, name));
+
+            return next;
+        }
+
+        int (*nextCondWait)(pthread_cond_t*, pthread_mutex_t*) = nullptr;
+        ssize_t (*nextRead)(int, void*, size_t) = nullptr;
+        ssize_t (*nextWrite)(int, const void*, size_t) = nullptr;
+        int (*nextNanosleep)(const timespec*, timespec*) = nullptr;
+        int (*nextUsleep)(useconds_t) = nullptr;
+
+        const char* getName(Violation violation)
+        {
+            switch (violation)
+            {
+                case Violation::allocation: return "allocation";
+                case Violation::deallocation: return "deallocation";
+                case Violation::mutexLock: return "mutex lock";
+                case Violation::systemCall: return "system call";
+            }
+
+            return "";
+        }
+    }
+
+    ScopedAudioCallback::ScopedAudioCallback() { ++callbackDepth; }
+    ScopedAudioCallback::~ScopedAudioCallback() { --callbackDepth; }
+
+    bool isEnabled() { return true; }
+    int getNumViolations() { return numViolations.load(); }
+
+    String getReport()
+    {
+        String report;
+        auto numRecorded = jmin(maxRecords, numViolations.load());
+
+        report << numViolations.load() << " real-time violations on the audio thread" << newLine;
+
+        for (auto i = 0; i < numRecorded; ++i)
+        {
+            auto& slot = records[(size_t) i];
+            report << newLine << "#" << (i + 1) << " " << getName(slot.violation) << newLine;
+
+            if (auto* symbols = backtrace_symbols(slot.frames, slot.numFrames))
+            {
+                // the first two frames are record() and the hook itself
+                for (auto frame = 2; frame < slot.numFrames; ++frame)
+                    report << "    " << symbols[frame] << newLine;
+
+                free(symbols);
+            }
+        }
+
+        return report;
+    }
+
+    // loads the stack walker, which allocates once, before any audio callback runs
+    static const bool stackWalkerLoaded = [] {
+        void* frames[1];
+        backtrace(frames, 1);
+        return true;
+    }();
+}
+
+using namespace RealtimeCheck;
+
+extern "C"
+{
+    void* __libc_malloc(size_t);
+    void* __libc_calloc(size_t, size_t);
+    void* __libc_realloc(void*, size_t);
+    void* __libc_memalign(size_t, size_t);
+    void __libc_free(void*);
+
+    void* malloc(size_t size)
+    {
+        record(Violation::allocation);
+        return __libc_malloc(size);
+    }
+
+    void* calloc(size_t count, size_t size)
+    {
+        record(Violation::allocation);
+        return __libc_calloc(count, size);
+    }
+
+    void* realloc(void* pointer, size_t size)
+    {
+        record(Violation::allocation);
+        return __libc_realloc(pointer, size);
+    }
+
+    int posix_memalign(void** pointer, size_t alignment, size_t size)
+    {
+        record(Violation::allocation);
+        *pointer = __libc_memalign(alignment, size);
+        return *pointer != nullptr ? 0 : ENOMEM;
+    }
+
+    void free(void* pointer)
+    {
+        if (pointer != nullptr)
+            record(Violation::deallocation);
+
+        __libc_free(pointer);
+    }
+
+    int __pthread_mutex_lock(pthread_mutex_t*);
+
+    int pthread_mutex_lock(pthread_mutex_t* mutex)
+    {
+        record(Violation::mutexLock);
+        return __pthread_mutex_lock(mutex);
+    }
+
+    int pthread_cond_wait(pthread_cond_t* condition, pthread_mutex_t* mutex)
+    {
+        record(Violation::systemCall);
+        return findNext(nextCondWait, "pthread_cond_wait")(condition, mutex);
+    }
+
+    ssize_t read(int file, void* buffer, size_t size)
+    {
+        record(Violation::systemCall);
+        return findNext(nextRead, "read")(file, buffer, size);
+    }
+
+    ssize_t write(int file, const void* buffer, size_t size)
+    {
+        record(Violation::systemCall);
+        return findNext(nextWrite, "write")(file, buffer, size);
+    }
+
+    int nanosleep(const timespec* duration, timespec* remaining)
+    {
+        record(Violation::systemCall);
+        return findNext(nextNanosleep, "nanosleep")(duration, remaining);
+    }
+
+    int usleep(useconds_t microseconds)
+    {
+        record(Violation::systemCall);
+        return findNext(nextUsleep, "usleep")(microseconds);
+    }
+}
+
+#endif
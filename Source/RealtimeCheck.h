@@ -0,0 +1,39 @@
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+// Debug instrumentation for the audio thread. Built with CHRONOMETRO_RT_CHECK=1 (Linux only), heap
+// allocation, mutex locks and blocking system calls made inside a ScopedAudioCallback are recorded
+// with their stack trace; otherwise everything here compiles away.
+namespace RealtimeCheck
+{
+    enum class Violation
+    {
+        allocation,
+        deallocation,
+        mutexLock,
+        systemCall
+    };
+
+#if CHRONOMETRO_RT_CHECK
+    struct ScopedAudioCallback
+    {
+        ScopedAudioCallback();
+        ~ScopedAudioCallback();
+    };
+
+    bool isEnabled();
+    int getNumViolations();
+
+    // symbolises the recorded stack traces, so it allocates; not for the audio thread
+    String getReport();
+#else
+    struct ScopedAudioCallback
+    {
+    };
+
+    inline bool isEnabled() { return false; }
+    inline int getNumViolations() { return 0; }
+    inline String getReport() { return {}; }
+#endif
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "Chronometro.h"
+#include "RealtimeCheck.h"
+
+// The real-time self-test, run by "--rt-check" in a build with CHRONOMETRO_RT_CHECK=1. A thread
+// plays the part of the audio device, calling the source at 48 kHz in blocks of 256 samples, while
+// the message thread goes through a scripted session the way a user would: start and stop, tempo
+// changes, sound switches, pattern edits and preset recalls. Any violation in the audio callback
+// is logged with its stack trace and makes the process exit with 1.
+class RealtimeCheckSession : private Thread, private Timer
+{
+public:
+    RealtimeCheckSession() : Thread("Simulated Audio Device"), beatAudioSource(musicMetre)
+    {
+        if (!RealtimeCheck::isEnabled())
+            Logger::writeToLog("This build has no real-time checker, configure it with CHRONOMETRO_RT_CHECK=ON");
+
+        beatAudioSource.prepareToPlay(blockSize, sampleRate);
+        startThread(9);
+        startTimer(stepMilliseconds);
+    }
+
+    ~RealtimeCheckSession() override
+    {
+        stopTimer();
+        stopThread(2000);
+        beatAudioSource.releaseResources();
+    }
+
+private:
+    void run() override
+    {
+        AudioSampleBuffer buffer(2, blockSize);
+        auto blockMilliseconds = 1000.0 * blockSize / sampleRate;
+        auto nextBlockTime = Time::getMillisecondCounterHiRes();
+
+        while (!threadShouldExit())
+        {
+            {
+                const RealtimeCheck::ScopedAudioCallback scopedAudioCallback;
+                beatAudioSource.getNextAudioBlock(AudioSourceChannelInfo(buffer));
+            }
+
+            nextBlockTime += blockMilliseconds;
+            Time::waitForMillisecondCounter((uint32) nextBlockTime);
+        }
+    }
+
+    void timerCallback() override
+    {
+        auto& valueTreeState = beatAudioSource.getValueTreeState();
+
+        auto setParameter = [&valueTreeState](const String& parameterID, float value) {
+            auto* parameter = valueTreeState.getParameter(parameterID);
+            parameter->setValueNotifyingHost(parameter->convertTo0to1(value));
+        };
+
+        switch (step++)
+        {
+            case 0: beatAudioSource.start(); break;
+            case 1: setParameter("tempo", 180.0f); break;
+            case 2: setParameter("Slot 1", 0.0f); break;
+            case 3: togglePulse(); break;
+            case 4: setParameter("tempo", 60.0f); break;
+            case 5: musicMetre.recallPreset(1); break;
+            case 6: setParameter("Slot 1", 1.0f); break;
+            case 7: beatAudioSource.stop(); break;
+            case 8: beatAudioSource.start(); break;
+            case 9: togglePulse(); break;
+            case 10: musicMetre.recallPreset(0); break;
+            case 11: setParameter("tempo", 120.0f); break;
+            case 12: beatAudioSource.stop(); break;
+
+            default:
+                finish();
+                break;
+        }
+    }
+
+    // an edit as the beat editor makes it, committed for the next beat
+    void togglePulse()
+    {
+        auto& pulse = *musicMetre.beatList.front()[1];
+        pulse.setHit(!pulse.getHit());
+        musicMetre.commitPattern();
+    }
+
+    void finish()
+    {
+        stopTimer();
+        stopThread(2000);
+
+        auto numViolations = RealtimeCheck::getNumViolations();
+        Logger::writeToLog(RealtimeCheck::getReport());
+
+        JUCEApplicationBase::getInstance()->setApplicationReturnValue(numViolations > 0 ? 1 : 0);
+        JUCEApplicationBase::quit();
+    }
+
+    static constexpr int blockSize = 256;
+    static constexpr double sampleRate = 48000.0;
+    static constexpr int stepMilliseconds = 500;
+
+    Music::Metre musicMetre;
+    BeatAudioSource beatAudioSource;
+
+    int step = 0;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(RealtimeCheckSession)
+};
@@ -0,0 +1,278 @@
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "Music.h"
+
+// Every sound the metronome can play, packed into one mono buffer at the device rate: the sine,
+// the built-in samples and the counting voice, one per beat number and per syllable of a
+// subdivision. The voice is read from the Voices folder in the app data, one file per voice named
+// "1.wav" to "16.wav", "and.wav", "e.wav", "a.wav", "trip.wav" and "let.wav" (any format the
+// manager reads); a file that is missing is played as the built-in block. A background thread
+// builds the table whenever the rate changes, and the audio thread only ever picks up a finished
+// one, so nothing is decoded on its way to be played.
+class SampleTable : private Thread
+{
+public:
+    // the choices of the sound parameters, in this order
+    enum class Sound
+    {
+        sine,
+        block,
+        fire,
+        voice
+    };
+
+    // the voice counts up to this and then starts over
+    static constexpr int maxCount = 16;
+
+    enum Entry
+    {
+        sineEntry,
+        blockEntry,
+        fireEntry,
+        firstVoiceEntry,
+        andEntry = firstVoiceEntry + maxCount,
+        eEntry,
+        aEntry,
+        tripEntry,
+        letEntry,
+        numEntries
+    };
+
+    // an entry is a stretch of the pool's buffer; voices that fall back share the block's
+    struct Sample
+    {
+        int start = 0;
+        int length = 0;
+    };
+
+    struct Pool : public ReferenceCountedObject
+    {
+        using Ptr = ReferenceCountedObjectPtr<Pool>;
+
+        AudioSampleBuffer samples;
+        std::array<Sample, numEntries> entries;
+        double sampleRate = 0.0;
+    };
+
+    explicit SampleTable(AudioFormatManager& formatManagerToUse) : Thread("Sample Table"), formatManager(formatManagerToUse)
+    {
+    }
+
+    ~SampleTable() override
+    {
+        stopThread(2000);
+    }
+
+    // builds the table for this rate in the background, unless it is already
+    void prepare(double sampleRate)
+    {
+        requestedSampleRate = sampleRate;
+
+        if (!isThreadRunning())
+            startThread(3);
+
+        notify();
+    }
+
+    // audio thread; swaps in the latest pool if there is one and the lock is free
+    void adoptLatest(Pool::Ptr& pool)
+    {
+        const SpinLock::ScopedTryLockType lock(poolLock);
+
+        if (lock.isLocked() && latestPool != nullptr)
+            pool = latestPool;
+    }
+
+    // the voice says the count on the first pulse of a beat, and "e-and-a" or "trip-let" on the others
+    static int getEntry(Sound sound, const Music::Pattern::Step& step, Music::NoteValue baseNoteValue)
+    {
+        if (sound != Sound::voice)
+            return (int) sound;
+
+        if (step.pulse == 0)
+            return firstVoiceEntry + step.count % maxCount;
+
+        switch ((int) step.noteValue / (int) baseNoteValue)
+        {
+            case 2: return andEntry;
+            case 3: return step.pulse == 1 ? tripEntry : letEntry;
+            case 4: return step.pulse == 1 ? eEntry : (step.pulse == 2 ? andEntry : aEntry);
+            default: return andEntry;
+        }
+    }
+
+    static StringArray getSoundNames() { return { "Sine", "LP_Jam_Block", "Fire", "Voice" }; }
+
+    static File getVoiceFolder()
+    {
+        return File::getSpecialLocation(File::userApplicationDataDirectory)
+            .getChildFile(ProjectInfo::projectName)
+            .getChildFile("Voices");
+    }
+
+private:
+    void run() override
+    {
+        while (!threadShouldExit())
+        {
+            auto sampleRate = requestedSampleRate.load();
+
+            if (sampleRate > 0.0 && (latestPool == nullptr || latestPool->sampleRate != sampleRate))
+            {
+                auto pool = createPool(sampleRate);
+
+                if (!threadShouldExit())
+                    publish(pool);
+            }
+
+            wait(-1);
+        }
+    }
+
+    Pool::Ptr createPool(double sampleRate)
+    {
+        Pool::Ptr pool = new Pool();
+        pool->sampleRate = sampleRate;
+
+        // the built-in samples play as many samples of their source as they always did
+        std::vector<AudioSampleBuffer> rendered { renderSine(sampleRate),
+                                                  decode(createBuiltInReader("LP_Jam_Block_ogg"), sampleRate, builtInLength),
+                                                  decode(createBuiltInReader("Fire_wav"), sampleRate, builtInLength) };
+        std::array<int, numEntries> sources {};
+
+        for (auto i = 0; i < firstVoiceEntry; ++i)
+            sources[(size_t) i] = i;
+
+        for (auto i = (int) firstVoiceEntry; i < numEntries && !threadShouldExit(); ++i)
+        {
+            auto voice = decode(std::unique_ptr<AudioFormatReader>(formatManager.createReaderFor(findVoiceFile(i))), sampleRate, -1);
+            sources[(size_t) i] = blockEntry;
+
+            if (voice.getNumSamples() > 0)
+            {
+                sources[(size_t) i] = (int) rendered.size();
+                rendered.push_back(std::move(voice));
+            }
+        }
+
+        // one buffer for all, so the audio thread reads from a single block of memory
+        auto totalLength = 0;
+
+        for (auto& sample : rendered)
+            totalLength += sample.getNumSamples();
+
+        pool->samples.setSize(1, jmax(1, totalLength));
+        pool->samples.clear();
+
+        std::vector<Sample> placed;
+        auto start = 0;
+
+        for (auto& sample : rendered)
+        {
+            pool->samples.copyFrom(0, start, sample, 0, 0, sample.getNumSamples());
+            placed.push_back({ start, sample.getNumSamples() });
+            start += sample.getNumSamples();
+        }
+
+        for (auto i = 0; i < numEntries; ++i)
+            pool->entries[(size_t) i] = placed[(size_t) sources[(size_t) i]];
+
+        return pool;
+    }
+
+    // long enough for the pulse's tail to fade it out, which it does after 2048 samples
+    static AudioSampleBuffer renderSine(double sampleRate)
+    {
+        AudioSampleBuffer sine(1, 4096);
+        auto delta = MathConstants<double>::twoPi * 1760.0 / sampleRate;
+
+        for (auto i = 0; i < sine.getNumSamples(); ++i)
+            sine.setSample(0, i, (float) std::sin(delta * i));
+
+        return sine;
+    }
+
+    std::unique_ptr<AudioFormatReader> createBuiltInReader(const char* resourceName)
+    {
+        int numBytes;
+        auto* binaryData = BinaryData::getNamedResource(resourceName, numBytes);
+
+        return std::unique_ptr<AudioFormatReader>(formatManager.createReaderFor(std::make_unique<MemoryInputStream>(binaryData, (size_t) numBytes, false)));
+    }
+
+    // the first channel, at most maxLength samples or else a second of it, resampled to the
+    // device rate and normalised
+    static AudioSampleBuffer decode(std::unique_ptr<AudioFormatReader> reader, double sampleRate, int maxLength)
+    {
+        if (reader == nullptr || reader->lengthInSamples <= 0 || reader->sampleRate <= 0.0)
+            return {};
+
+        auto sourceLength = (int) jmin(reader->lengthInSamples, maxLength > 0 ? (int64) maxLength : (int64) reader->sampleRate);
+        AudioSampleBuffer source(1, sourceLength + 4);
+        source.clear();
+        reader->read(&source, 0, sourceLength, 0, true, false);
+
+        auto speedRatio = reader->sampleRate / sampleRate;
+        AudioSampleBuffer sample(1, (int) (sourceLength / speedRatio));
+
+        LagrangeInterpolator interpolator;
+        interpolator.process(speedRatio, source.getReadPointer(0), sample.getWritePointer(0), sample.getNumSamples());
+
+        auto maxMagnitude = sample.getMagnitude(0, 0, sample.getNumSamples());
+
+        if (maxMagnitude <= 0.0f)
+            return {};
+
+        sample.applyGain(1.0f / maxMagnitude);
+        return sample;
+    }
+
+    File findVoiceFile(int entry) const
+    {
+        for (auto* format : formatManager)
+            for (auto& extension : format->getFileExtensions())
+            {
+                auto file = getVoiceFolder().getChildFile(getVoiceName(entry) + extension);
+
+                if (file.existsAsFile())
+                    return file;
+            }
+
+        return {};
+    }
+
+    static String getVoiceName(int entry)
+    {
+        static const char* syllables[] = { "and", "e", "a", "trip", "let" };
+
+        return entry < andEntry ? String(entry - firstVoiceEntry + 1) : String(syllables[entry - andEntry]);
+    }
+
+    // the audio thread may still play an older pool, so the pools are only freed here
+    void publish(Pool::Ptr pool)
+    {
+        pools.add(pool);
+
+        {
+            const SpinLock::ScopedLockType lock(poolLock);
+            latestPool = pool;
+        }
+
+        for (auto i = pools.size(); --i >= 0;)
+            if (pools.getObjectPointerUnchecked(i)->getReferenceCount() == 1)
+                pools.remove(i);
+    }
+
+    static constexpr int builtInLength = 1 << 11;
+
+    AudioFormatManager& formatManager;
+
+    std::atomic<double> requestedSampleRate { 0.0 };
+
+    ReferenceCountedArray<Pool> pools;
+    SpinLock poolLock;
+    Pool::Ptr latestPool;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SampleTable)
+};
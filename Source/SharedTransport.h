@@ -0,0 +1,302 @@
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "Music.h"
+
+// Tempo and beat phase of one instance, shared with other processes on the same machine through a
+// memory-mapped file. There is a single writer (the publisher's audio thread); readers never block
+// it and retry when they catch a write in progress (sequence lock). The file is only mapped once
+// publishing or following is chosen, and the publisher role is held through an inter-process lock,
+// which the system lets go of when the process ends.
+class SharedTransport
+{
+public:
+    struct Snapshot
+    {
+        double tempo = 0.0; // in beats of the publisher's base note, as are beat and numBeats
+        double beatTime = 0.0; // Time::getMillisecondCounterHiRes of the latest beat onset
+        int beat = 0;
+        int numBeats = 0;
+        int baseNoteValue = 4;
+        int64 sampleTime = 0;
+        double sampleRate = 0.0;
+        bool playing = false;
+    };
+
+    explicit SharedTransport(const String& name = ProjectInfo::projectName)
+        : transportName(name), publisherLock(name + ".publisher")
+    {
+    }
+
+    ~SharedTransport()
+    {
+        releasePublisher();
+    }
+
+    // message thread, before the transport is handed to the audio thread; the mapping then stays
+    // until destruction, so a reader never sees it go away
+    bool open()
+    {
+        if (layout != nullptr)
+            return true;
+
+        auto file = getDirectory().getChildFile(transportName + ".transport");
+
+        if (file.getSize() != (int64) sizeof(Layout))
+        {
+            MemoryBlock empty(sizeof(Layout), true);
+            file.replaceWithData(empty.getData(), empty.getSize());
+        }
+
+        mappedFile.reset(new MemoryMappedFile(file, MemoryMappedFile::readWrite, false));
+
+        if (mappedFile->getData() == nullptr || mappedFile->getSize() < sizeof(Layout))
+        {
+            mappedFile.reset();
+            return false;
+        }
+
+        layout = static_cast<Layout*>(mappedFile->getData());
+        return true;
+    }
+
+    bool isOpen() const { return layout != nullptr; }
+
+    // message thread; false while another process publishes, as the sequence lock allows one writer
+    bool claimPublisher()
+    {
+        if (!isPublisher)
+            isPublisher = open() && publisherLock.enter(0);
+
+        return isPublisher;
+    }
+
+    void releasePublisher()
+    {
+        if (isPublisher)
+            publisherLock.exit();
+
+        isPublisher = false;
+    }
+
+    // audio thread of the publisher
+    void publishBeat(double beatTime, float tempo, int beat, int numBeats, int baseNoteValue, int64 sampleTime, double sampleRate)
+    {
+        if (layout == nullptr)
+            return;
+
+        beginWrite();
+        layout->tempo.store(tempo, std::memory_order_relaxed);
+        layout->beatTime.store(beatTime, std::memory_order_relaxed);
+        layout->beat.store(beat, std::memory_order_relaxed);
+        layout->numBeats.store(numBeats, std::memory_order_relaxed);
+        layout->baseNoteValue.store(baseNoteValue, std::memory_order_relaxed);
+        layout->sampleTime.store(sampleTime, std::memory_order_relaxed);
+        layout->sampleRate.store(sampleRate, std::memory_order_relaxed);
+        layout->playing.store(1, std::memory_order_relaxed);
+        endWrite();
+    }
+
+    void publishStop()
+    {
+        if (layout == nullptr)
+            return;
+
+        beginWrite();
+        layout->playing.store(0, std::memory_order_relaxed);
+        endWrite();
+    }
+
+    // any thread of a follower, lock-free
+    bool read(Snapshot& snapshot) const
+    {
+        if (layout == nullptr)
+            return false;
+
+        for (auto attempt = 0; attempt < 16; ++attempt)
+        {
+            auto sequence = layout->sequence.load(std::memory_order_acquire);
+
+            if ((sequence & 1) != 0)
+                continue;
+
+            snapshot.tempo = layout->tempo.load(std::memory_order_relaxed);
+            snapshot.beatTime = layout->beatTime.load(std::memory_order_relaxed);
+            snapshot.beat = layout->beat.load(std::memory_order_relaxed);
+            snapshot.numBeats = layout->numBeats.load(std::memory_order_relaxed);
+            snapshot.baseNoteValue = jmax(1, (int) layout->baseNoteValue.load(std::memory_order_relaxed));
+            snapshot.sampleTime = layout->sampleTime.load(std::memory_order_relaxed);
+            snapshot.sampleRate = layout->sampleRate.load(std::memory_order_relaxed);
+            snapshot.playing = layout->playing.load(std::memory_order_relaxed) != 0;
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (layout->sequence.load(std::memory_order_relaxed) == sequence)
+                return true;
+        }
+
+        return false;
+    }
+
+private:
+    struct Layout
+    {
+        std::atomic<uint32> sequence;
+        std::atomic<int32> playing;
+        std::atomic<double> tempo;
+        std::atomic<double> beatTime;
+        std::atomic<int32> beat;
+        std::atomic<int32> numBeats;
+        std::atomic<int32> baseNoteValue;
+        std::atomic<int64> sampleTime;
+        std::atomic<double> sampleRate;
+    };
+
+    static_assert(std::atomic<double>::is_always_lock_free && std::atomic<int64>::is_always_lock_free,
+                  "the shared transport needs lock-free 64 bit atomics");
+
+    void beginWrite()
+    {
+        layout->sequence.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void endWrite()
+    {
+        layout->sequence.fetch_add(1, std::memory_order_release);
+    }
+
+    static File getDirectory()
+    {
+#if JUCE_LINUX
+        File sharedMemory("/dev/shm");
+
+        if (sharedMemory.isDirectory())
+            return sharedMemory;
+#endif
+        return File::getSpecialLocation(File::tempDirectory);
+    }
+
+    const String transportName;
+    InterProcessLock publisherLock;
+    bool isPublisher = false;
+
+    std::unique_ptr<MemoryMappedFile> mappedFile;
+    Layout* layout = nullptr;
+};
+
+// Follows the transport another instance publishes. The audio thread reads the beat phase when it
+// needs it; a timer on the message thread reports tempo and start/stop changes.
+class SharedTransportFollower : public Music::ClockFollower, private Timer
+{
+public:
+    SharedTransportFollower(SharedTransport& transport) : sharedTransport(transport) {}
+
+    // message thread
+    void setEnabled(bool shouldBeEnabled)
+    {
+        enabled = shouldBeEnabled && sharedTransport.open();
+
+        if (enabled)
+            startTimer(50);
+        else
+            stopTimer();
+    }
+
+    bool isEnabled() const { return enabled; }
+
+    bool isLocked() const override
+    {
+        SharedTransport::Snapshot snapshot;
+
+        if (!enabled || !sharedTransport.read(snapshot) || !snapshot.playing || snapshot.tempo <= 0.0)
+            return false;
+
+        // a publisher that has gone away leaves its last beat behind
+        return Time::getMillisecondCounterHiRes() - snapshot.beatTime < 2.0 * 60000.0 / snapshot.tempo + 100.0;
+    }
+
+    // in beats of this instance's base note, as the MIDI clock follower counts them
+    float getTempo() const override
+    {
+        SharedTransport::Snapshot snapshot;
+
+        return sharedTransport.read(snapshot) ? (float) (snapshot.tempo * getBeatRatio(snapshot)) : 0.0f;
+    }
+
+    void setBaseNoteValue(Music::NoteValue noteValue) override
+    {
+        baseNoteValue.store((int) noteValue, std::memory_order_relaxed);
+    }
+
+    // the bar rather than the nearest beat, so the downbeats of both instances line up as well
+    double getPhaseError(double onsetTime, int beat) const override
+    {
+        SharedTransport::Snapshot snapshot;
+
+        if (!sharedTransport.read(snapshot) || snapshot.tempo <= 0.0 || snapshot.numBeats <= 0)
+            return 0.0;
+
+        auto ratio = getBeatRatio(snapshot);
+        auto beatPeriod = 60000.0 / (snapshot.tempo * ratio);
+        auto numBeats = snapshot.numBeats * ratio;
+        auto offset = getPublisherPosition(snapshot, onsetTime) * ratio - beat;
+
+        return beatPeriod * (offset - numBeats * std::round(offset / numBeats));
+    }
+
+    bool getBarPosition(double time, double& beatPosition) const override
+    {
+        SharedTransport::Snapshot snapshot;
+
+        if (!sharedTransport.read(snapshot) || snapshot.tempo <= 0.0 || snapshot.numBeats <= 0)
+            return false;
+
+        auto ratio = getBeatRatio(snapshot);
+        auto numBeats = snapshot.numBeats * ratio;
+        auto position = getPublisherPosition(snapshot, time) * ratio;
+        beatPosition = position - numBeats * std::floor(position / numBeats);
+
+        return true;
+    }
+
+    std::function<void(float)> onTempoChange;
+    std::function<void(bool)> onTransportChange;
+
+private:
+    // this instance's beats per beat of the publisher, e.g. 2 for eighths following quarters
+    double getBeatRatio(const SharedTransport::Snapshot& snapshot) const
+    {
+        return baseNoteValue.load(std::memory_order_relaxed) / (double) snapshot.baseNoteValue;
+    }
+
+    // in beats of the publisher from the start of its bar
+    static double getPublisherPosition(const SharedTransport::Snapshot& snapshot, double time)
+    {
+        return snapshot.beat + (time - snapshot.beatTime) * snapshot.tempo / 60000.0;
+    }
+
+    void timerCallback() override
+    {
+        SharedTransport::Snapshot snapshot;
+
+        if (!sharedTransport.read(snapshot))
+            return;
+
+        if (snapshot.playing != wasPlaying && onTransportChange != nullptr)
+            onTransportChange(snapshot.playing);
+
+        if (snapshot.playing && std::abs(snapshot.tempo - lastTempo) >= 0.01 && onTempoChange != nullptr)
+            onTempoChange((float) (snapshot.tempo * getBeatRatio(snapshot)));
+
+        wasPlaying = snapshot.playing;
+        lastTempo = snapshot.tempo;
+    }
+
+    SharedTransport& sharedTransport;
+
+    std::atomic<bool> enabled { false };
+    std::atomic<int> baseNoteValue { 4 };
+    bool wasPlaying = false;
+    double lastTempo = 0.0;
+};
@@ -2,389 +2,493 @@
 
 #include "../JuceLibraryCode/JuceHeader.h"
 #include "Music.h"
-#include <algorithm>
-#include <map>
-
-class ProcessorBase : public AudioProcessor
+#include "PulseLoop.h"
+#include "SampleTable.h"
+
+// Plays every pulse with one voice, which reads the sound of the pulse's category (downbeat, accent,
+// beat or subdivision) from the shared sample table. Changing a sound only changes which entry the
+// next onset reads, so nothing is rebuilt or reconnected on the audio thread. With the pre-rendered
+// loop on, a pattern that plays on unchanged is copied from a bar rendered in the background.
+class SoundStallProcessor : public AudioProcessor, private AudioProcessorValueTreeState::Listener, private Timer
 {
 public:
-    ProcessorBase() {}
-
-    void prepareToPlay(double, int) override {}
-    void releaseResources() override {}
-    void processBlock(AudioSampleBuffer&, MidiBuffer&) override {}
+    using Sound = SampleTable::Sound;
 
-    AudioProcessorEditor* createEditor() override { return nullptr; }
-    bool hasEditor() const override { return false; }
-
-    const String getName() const override { return {}; }
-    bool acceptsMidi() const override { return false; }
-    bool producesMidi() const override { return false; }
-    double getTailLengthSeconds() const override { return 0; }
+    SoundStallProcessor(Music::Metre& metre)
+        : musicMetre(metre),
+          AudioProcessor(BusesProperties().withInput("Input", juce::AudioChannelSet::stereo(), true).withOutput("Output", AudioChannelSet::stereo(), true)),
+          parameters(*this, nullptr, "SoundStall", createParameterLayout())
+    {
+        soundParameters = { parameters.getRawParameterValue("Slot 1"),
+                            parameters.getRawParameterValue("downbeatSound"),
+                            parameters.getRawParameterValue("accentSound"),
+                            parameters.getRawParameterValue("subdivisionSound") };
+
+        subdivisionLevelParameter = parameters.getRawParameterValue("subdivisionLevel");
+        gainParameter = parameters.getRawParameterValue("gain");
+        levelParameter = parameters.getRawParameterValue("level1");
+        accentParameter = parameters.getRawParameterValue("accent");
+        panParameter = parameters.getRawParameterValue("pan1");
+        spreadParameter = parameters.getRawParameterValue("spread");
+
+        parameters.addParameterListener("tempo", this);
+        parameters.addParameterListener("groove", this);
+        parameters.addParameterListener("swing", this);
+        parameters.addParameterListener("loop", this);
+        musicMetre.setBPM(*parameters.getRawParameterValue("tempo"));
 
-    int getNumPrograms() override { return 0; }
-    int getCurrentProgram() override { return 0; }
-    void setCurrentProgram(int) override {}
-    const String getProgramName(int) override { return {}; }
-    void changeProgramName(int, const String&) override {}
+        formatManager.registerBasicFormats();
 
-    void getStateInformation(MemoryBlock&) override {}
-    void setStateInformation(const void*, int) override {}
+        // a host or an embedder may process before it prepares, the ramp then works in pieces
+        rampBuffer.allocate((size_t) defaultRampSize, true);
+        rampBufferSize = defaultRampSize;
 
-private:
-    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ProcessorBase)
-};
+        startTimer(groovePollMilliseconds);
+    }
 
-class OscillatorProcessor : public ProcessorBase
-{
-public:
-    OscillatorProcessor(const String name, Music::Metre& metre) : name(name), musicMetre(metre)
+    ~SoundStallProcessor() override
     {
-        oscillator.setFrequency(1760.0f);
-        oscillator.initialise([](float x) { return std::sin(x); }, 128);
+        parameters.removeParameterListener("tempo", this);
+        parameters.removeParameterListener("groove", this);
+        parameters.removeParameterListener("swing", this);
+        parameters.removeParameterListener("loop", this);
+        stopTimer();
     }
 
     void prepareToPlay(double sampleRate, int samplesPerBlock) override
     {
-        juce::dsp::ProcessSpec spec { sampleRate, static_cast<uint32>(samplesPerBlock) };
-        oscillator.prepare(spec);
+        setRateAndBufferSizeDetails(sampleRate, samplesPerBlock);
+
+        // the table is built before the transport gets to it; a new rate keeps the old one playing
+        // until the new one is done
+        sampleTable.prepare(sampleRate);
+
+        rampBufferSize = jmax(defaultRampSize, samplesPerBlock);
+        rampBuffer.allocate((size_t) rampBufferSize, true);
+
+        gainSmoother.reset(sampleRate, 0.05);
+        gainSmoother.setCurrentAndTargetValue(Decibels::decibelsToGain(gainParameter->load()));
+        levelSmoother.reset(sampleRate, 0.05);
+        levelSmoother.setCurrentAndTargetValue(Decibels::decibelsToGain(levelParameter->load()));
     }
 
+    void releaseResources() override {}
+
     void processBlock(AudioSampleBuffer& buffer, MidiBuffer&) override
     {
-        for (auto i = 0; i < buffer.getNumSamples(); ++i)
-        {
-            auto pulseSample = musicMetre.getPulseSample(*this);
-            auto currentSample = oscillator.processSample(0.0f);
+        musicMetre.beginBlock();
+        blockPlayed.store(true, std::memory_order_relaxed);
 
-            currentSample *= pulseSample;
+        if (!playLoop(buffer.getWritePointer(0), buffer.getNumSamples()))
+            renderPulses(buffer.getWritePointer(0), buffer.getNumSamples());
 
-            for (auto channel = 0; channel < buffer.getNumChannels(); ++channel)
-            {
-                auto* outBuffer = buffer.getWritePointer(channel);
-                outBuffer[i] = currentSample;
-            }
-        }
+        levelSmoother.setTargetValue(Decibels::decibelsToGain(levelParameter->load()));
+        gainSmoother.setTargetValue(Decibels::decibelsToGain(gainParameter->load()));
+
+        // the sound is still mono here, so level and gain are applied to one channel only
+        AudioSampleBuffer monoBuffer { buffer.getArrayOfWritePointers(), 1, buffer.getNumSamples() };
+
+        applySmoothedGain(monoBuffer, levelSmoother);
+        applySmoothedGain(monoBuffer, gainSmoother);
+
+        panToChannels(buffer);
     }
 
+    // called by the Metre as a pulse ends, and on a stop
     void reset() override
     {
-        oscillator.reset();
+        isOnset = true;
+        pulseSound = {};
+        currentIndex = 0;
     }
 
-    const String getName() const override { return name; }
+    AudioProcessorEditor* createEditor() override { return new GenericAudioProcessorEditor(*this); }
+    bool hasEditor() const override { return true; }
 
-private:
-    const String name;
-    Music::Metre& musicMetre;
+    const String getName() const override { return "Sound Stall"; }
+    bool acceptsMidi() const override { return false; }
+    bool producesMidi() const override { return false; }
+    double getTailLengthSeconds() const override { return 0; }
 
-    juce::dsp::Oscillator<float> oscillator;
-};
+    int getNumPrograms() override { return jmax(1, musicMetre.presetBank.size()); }
+    int getCurrentProgram() override { return musicMetre.getCurrentPreset(); }
+    void setCurrentProgram(int index) override { musicMetre.recallPreset(index); }
 
-class AudioFileProcessor : public ProcessorBase
-{
-public:
-    AudioFileProcessor(const String name, Music::Metre& metre, AudioFormatManager& formatManager)
-        : name(name), musicMetre(metre), formatManager(formatManager)
+    const String getProgramName(int index) override
     {
-        int numBytes;
-        auto* binaryData = BinaryData::getNamedResource(soundMap[name.toStdString()], numBytes);
-        auto* audioFormatReader = formatManager.createReaderFor(std::make_unique<MemoryInputStream>(static_cast<const void*>(binaryData), numBytes, false));
-        std::unique_ptr<AudioFormatReader> reader(audioFormatReader);
-
-        if (reader.get() != nullptr)
-        {
-            audioFileBuffer.setSize(1, bufferSize);
-            reader->read(audioFileBuffer.getArrayOfWritePointers(), 1, 0, bufferSize);
-            sourceSampleRate = reader->sampleRate;
-
-            auto maxMagnitude = audioFileBuffer.getMagnitude(0, 0, bufferSize);
-
-            jassert(maxMagnitude > 0);
-            audioFileBuffer.applyGain(0, 0, bufferSize, 1 / maxMagnitude);
+        if (auto preset = musicMetre.presetBank.getPreset(index))
+            return preset->name;
 
-            lookupTable.initialise([&](size_t i) { return audioFileBuffer.getSample(0, (int) i); }, bufferSize);
-        }
+        return {};
     }
 
-    void prepareToPlay(double sampleRate, int samplesPerBlock) override
-    {
-        tableDelta = sourceSampleRate / sampleRate;
-    }
+    void changeProgramName(int, const String&) override {}
 
-    void processBlock(AudioSampleBuffer& buffer, MidiBuffer&) override
+    void getStateInformation(MemoryBlock& destData) override
     {
-        for (auto i = 0; i < buffer.getNumSamples(); ++i)
-        {
-            auto pulseSample = musicMetre.getPulseSample(*this);
-            auto currentSample = lookupTable.getUnchecked(currentIndex);
+        MemoryOutputStream stream(destData, false);
 
-            if ((currentIndex + tableDelta) >= bufferSize)
-                currentSample = 0.0f;
-            else
-                currentIndex += tableDelta;
+        stream.writeInt(stateMagic);
+        stream.writeInt(stateVersion);
 
-            currentSample *= pulseSample;
+        auto& processorParameters = getParameters();
+        stream.writeCompressedInt(processorParameters.size());
 
-            for (auto channel = 0; channel < buffer.getNumChannels(); ++channel)
-            {
-                auto* outBuffer = buffer.getWritePointer(channel);
-                outBuffer[i] = currentSample;
-            }
+        for (auto* parameter : processorParameters)
+        {
+            stream.writeString(static_cast<AudioProcessorParameterWithID*>(parameter)->paramID);
+            stream.writeFloat(parameter->getValue());
         }
-    }
 
-    void reset() override
-    {
-        currentIndex = 0.0f;
+        musicMetre.writeState(stream);
+        musicMetre.presetBank.writeTo(stream);
     }
 
-    const String getName() const override { return name; }
+    void setStateInformation(const void* data, int sizeInBytes) override
+    {
+        MemoryInputStream stream(data, (size_t) sizeInBytes, false);
 
-private:
-    const String name;
-    Music::Metre& musicMetre;
+        if (stream.readInt() != stateMagic)
+            return;
 
-    std::map<std::string, const char*> soundMap {
-        { "LP_Jam_Block", "LP_Jam_Block_ogg" },
-        { "Fire", "Fire_wav" }
-    };
+        auto version = stream.readInt();
 
-    AudioFormatManager& formatManager;
-    AudioSampleBuffer audioFileBuffer;
+        if (version > stateVersion)
+            return;
 
-    juce::dsp::LookupTable<float> lookupTable;
+        auto numParameters = stream.readCompressedInt();
 
-    const unsigned int bufferSize = 1 << 11;
-    double sourceSampleRate = 0.0;
-    float currentIndex = 0.0f, tableDelta = 0.0f;
-};
+        for (auto i = 0; i < numParameters && !stream.isExhausted(); ++i)
+        {
+            auto parameterID = stream.readString();
+            auto value = stream.readFloat();
 
-class SoundStallProcessor : public AudioProcessor
-{
-public:
-    using AudioGraphIOProcessor = AudioProcessorGraph::AudioGraphIOProcessor;
-    using Node = AudioProcessorGraph::Node;
+            // the sound choice grew by the voice in version 4, which moved the normalised values
+            if (version < 4 && parameterID == "Slot 1")
+                value = (float) roundToInt(value * 2.0f) / 3.0f;
 
-    SoundStallProcessor(Music::Metre& metre)
-        : musicMetre(metre),
-          AudioProcessor(BusesProperties().withInput("Input", juce::AudioChannelSet::stereo(), true).withOutput("Output", AudioChannelSet::stereo(), true)),
-          mainProcessor(new AudioProcessorGraph()),
-          processorSlot1(new AudioParameterChoice("Slot 1", "Sound", processorChoices, 1))
-    {
-        addParameter(processorSlot1);
+            if (auto* parameter = parameters.getParameter(parameterID))
+                parameter->setValueNotifyingHost(value);
+        }
 
-        formatManager.registerBasicFormats();
+        // from version 3 every pattern carries its metre
+        if (musicMetre.readState(stream, version >= 3) && version >= 2)
+            musicMetre.presetBank.readFrom(stream, version >= 3);
     }
 
-    void prepareToPlay(double sampleRate, int samplesPerBlock) override
-    {
-        mainProcessor->setPlayConfigDetails(getMainBusNumInputChannels(),
-                                            getMainBusNumOutputChannels(),
-                                            sampleRate,
-                                            samplesPerBlock);
+    AudioProcessorValueTreeState& getValueTreeState() { return parameters; }
 
-        mainProcessor->prepareToPlay(sampleRate, samplesPerBlock);
+private:
+    static constexpr int stateMagic = 0x4e524843; // "CHRN"
+    static constexpr int stateVersion = 4;
 
-        initialiseGraph();
+    AudioProcessorValueTreeState::ParameterLayout createParameterLayout()
+    {
+        NormalisableRange<float> decibelRange { -60.0f, 0.0f, 0.01f };
+        decibelRange.setSkewForCentre(-10.0f);
+
+        return {
+            std::make_unique<AudioParameterChoice>("Slot 1", "Sound", SampleTable::getSoundNames(), 1),
+            std::make_unique<AudioParameterFloat>("tempo", "Tempo", NormalisableRange<float> { 20.0f, 999.0f, 0.01f }, 120.0f, "BPM"),
+            std::make_unique<AudioParameterFloat>("gain", "Gain", decibelRange, Decibels::gainToDecibels(0.3f), "dB"),
+            std::make_unique<AudioParameterFloat>("level1", "Slot 1 Level", decibelRange, 0.0f, "dB"),
+            std::make_unique<AudioParameterFloat>("pan1", "Slot 1 Pan", NormalisableRange<float> { -1.0f, 1.0f }, 0.0f),
+            std::make_unique<AudioParameterFloat>("spread", "Subdivision Spread", NormalisableRange<float> { 0.0f, 1.0f }, 0.0f),
+            std::make_unique<AudioParameterFloat>("accent", "Accent Depth", NormalisableRange<float> { 0.0f, 1.0f }, 0.5f),
+            std::make_unique<AudioParameterChoice>("groove", "Groove", getGrooveNames(), 0),
+            std::make_unique<AudioParameterFloat>("swing", "Swing", NormalisableRange<float> { 50.0f, 75.0f, 0.1f }, 60.0f, "%"),
+            std::make_unique<AudioParameterChoice>("downbeatSound", "Downbeat Sound", getCategoryChoices(), 0),
+            std::make_unique<AudioParameterChoice>("accentSound", "Accent Sound", getCategoryChoices(), 0),
+            std::make_unique<AudioParameterChoice>("subdivisionSound", "Subdivision Sound", getCategoryChoices(), 0),
+            std::make_unique<AudioParameterFloat>("subdivisionLevel", "Subdivision Level", decibelRange, 0.0f, "dB"),
+            std::make_unique<AudioParameterBool>("loop", "Pre-rendered Loop", false)
+        };
     }
 
-    void releaseResources() override
+    void parameterChanged(const String& parameterID, float newValue) override
     {
-        mainProcessor->releaseResources();
+        // may be called from the audio thread by automation, Metre only stores it atomically
+        if (parameterID == "tempo")
+            musicMetre.setBPM(newValue);
+        else if (parameterID == "loop")
+            pulseLoop.setEnabled(newValue >= 0.5f);
+        else
+            grooveChanged = true;
     }
 
-    void processBlock(AudioSampleBuffer& buffer, MidiBuffer& midiMessages) override
+    // the groove recompiles the pattern, which is only done on the message thread; automation on
+    // the audio thread only raises a flag, as posting a message could lock or allocate there
+    void timerCallback() override
     {
-        updateGraph();
+        if (grooveChanged.exchange(false))
+        {
+            auto grooveIndex = static_cast<AudioParameterChoice*>(parameters.getParameter("groove"))->getIndex();
+
+            if (grooveIndex == swingGroove)
+                musicMetre.setGroove(Music::Groove::swing(parameters.getRawParameterValue("swing")->load() / 100.0f));
+            else
+                musicMetre.setGroove(grooveTemplates[(size_t) grooveIndex]);
+        }
 
-        mainProcessor->processBlock(buffer, midiMessages);
+        // the loop thread sleeps while the transport is stopped
+        if (blockPlayed.exchange(false) && pulseLoop.isEnabled())
+            pulseLoop.refresh();
     }
 
-    void reset() override
+    // the built-in grooves, then the templates of the user, one per line of Grooves.txt in the app
+    // data folder as "name = offset offset ...", e.g. "Laid back = 0 0.1 0.05 0.1"
+    static std::vector<Music::Groove> loadGrooveTemplates()
     {
-        if (slot1Node != nullptr)
-            slot1Node->getProcessor()->reset();
-    }
+        std::vector<Music::Groove> templates { { "Straight", {} }, { "Swing", {} }, { "Shuffle", { 0.0f, 1.0f / 3.0f } } };
 
-    AudioProcessorEditor* createEditor() override { return new GenericAudioProcessorEditor(*this); }
-    bool hasEditor() const override { return true; }
+        auto file = File::getSpecialLocation(File::userApplicationDataDirectory)
+                        .getChildFile(ProjectInfo::projectName)
+                        .getChildFile("Grooves.txt");
 
-    const String getName() const override { return "Sound Stall"; }
-    bool acceptsMidi() const override { return false; }
-    bool producesMidi() const override { return false; }
-    double getTailLengthSeconds() const override { return 0; }
+        for (auto line : StringArray::fromLines(file.loadFileAsString()))
+        {
+            auto name = line.upToFirstOccurrenceOf("=", false, false).trim();
+            auto offsets = StringArray::fromTokens(line.fromFirstOccurrenceOf("=", false, false), " ,", "");
+            offsets.removeEmptyStrings();
 
-    int getNumPrograms() override { return 1; }
-    int getCurrentProgram() override { return 0; }
-    void setCurrentProgram(int) override {}
-    const String getProgramName(int) override { return {}; }
-    void changeProgramName(int, const String&) override {}
+            if (name.isEmpty() || offsets.isEmpty())
+                continue;
 
-    void getStateInformation(MemoryBlock&) override {}
-    void setStateInformation(const void*, int) override {}
+            Music::Groove groove { name, {} };
 
-    enum class Waveform
-    {
-        Sine,
-        LP_Jam_Block,
-        Fire
-    };
+            for (auto& offset : offsets)
+                groove.offsets.push_back(offset.getFloatValue());
 
-private:
-    void initialiseGraph()
+            templates.push_back(std::move(groove));
+        }
+
+        return templates;
+    }
+
+    StringArray getGrooveNames() const
     {
-        mainProcessor->clear();
+        StringArray names;
 
-        audioInputNode = mainProcessor->addNode(std::make_unique<AudioGraphIOProcessor>(AudioGraphIOProcessor::audioInputNode));
-        audioOutputNode = mainProcessor->addNode(std::make_unique<AudioGraphIOProcessor>(AudioGraphIOProcessor::audioOutputNode));
+        for (auto& groove : grooveTemplates)
+            names.add(groove.name);
 
-        connectAudioNodes();
+        return names;
     }
 
-    void updateGraph()
+    void applySmoothedGain(AudioSampleBuffer& buffer, SmoothedValue<float>& smoother)
     {
-        bool hasChanged = false;
+        if (!smoother.isSmoothing())
+        {
+            buffer.applyGain(smoother.getTargetValue());
+            return;
+        }
 
-        ReferenceCountedArray<Node> slots;
-        slots.add(slot1Node);
+        if (rampBufferSize <= 0)
+            return;
 
-        auto waveformIndex = processorSlot1->getIndex();
-        auto slot = slots.getUnchecked(0);
+        // fill the ramp once, then apply it to every channel with vector operations
+        for (auto start = 0; start < buffer.getNumSamples(); start += rampBufferSize)
+        {
+            auto numSamples = jmin(rampBufferSize, buffer.getNumSamples() - start);
 
-        bool shouldAddNode = false;
+            for (auto i = 0; i < numSamples; ++i)
+                rampBuffer[i] = smoother.getNextValue();
 
-        auto checkNodeIfExist = [&]() {
-            if (slot != nullptr)
-            {
-                if (slot->getProcessor()->getName() == processorChoices[waveformIndex])
-                    return;
+            for (auto channel = 0; channel < buffer.getNumChannels(); ++channel)
+                FloatVectorOperations::multiply(buffer.getWritePointer(channel, start), rampBuffer, numSamples);
+        }
+    }
+
+    // Fans the mono sound of the first channel out to all of them. The pan is the slot's, moved
+    // by the spread to alternate sides for the pulses after the first of each beat; it changes at
+    // onsets only, so each stretch between two onsets takes one vector operation per channel.
+    void panToChannels(AudioSampleBuffer& buffer)
+    {
+        auto* events = musicMetre.getEvents();
+        auto numEvents = musicMetre.getNumEvents();
+        auto start = 0;
+
+        for (auto i = 0; i <= numEvents; ++i)
+        {
+            auto end = i < numEvents ? jlimit(start, buffer.getNumSamples(), events[i].samplePosition) : buffer.getNumSamples();
+
+            fanOut(buffer, start, end - start);
+            start = end;
 
-                mainProcessor->disconnectNode(slot->nodeID);
-                slot->getProcessor()->reset();
+            if (i < numEvents)
+            {
+                pulseInBeat = events[i].isBeatStart ? 0 : pulseInBeat + 1;
+                pulsePanOffset = pulseInBeat == 0 ? 0.0f : (pulseInBeat % 2 == 1 ? -1.0f : 1.0f);
             }
+        }
+    }
 
-            auto isEqual = [&](const auto& p) { return p->getProcessor()->getName() == processorChoices[waveformIndex]; };
-            auto found = std::find_if(processorNodePtrs.begin(), processorNodePtrs.end(), isEqual);
+    void fanOut(AudioSampleBuffer& buffer, int startSample, int numSamples)
+    {
+        if (numSamples <= 0 || buffer.getNumChannels() < 2)
+            return;
 
-            if (found != processorNodePtrs.end())
-                slots.set(0, *found);
-            else
-                shouldAddNode = true;
+        auto pan = jlimit(-1.0f, 1.0f, panParameter->load() + pulsePanOffset * spreadParameter->load());
 
-            hasChanged = true;
-        };
+        // constant power, scaled so the centre keeps the level of the mono sound
+        auto angle = (pan + 1.0f) * MathConstants<float>::pi * 0.25f;
+        float gains[] = { MathConstants<float>::sqrt2 * std::cos(angle), MathConstants<float>::sqrt2 * std::sin(angle) };
 
-        switch (static_cast<Waveform>(waveformIndex))
-        {
-            case Waveform::Sine:
-            {
-                checkNodeIfExist();
+        auto* monoBuffer = buffer.getWritePointer(0, startSample);
 
-                if (shouldAddNode)
-                {
-                    slots.set(0, mainProcessor->addNode(std::make_unique<OscillatorProcessor>(processorChoices[waveformIndex], musicMetre)));
-                    processorNodePtrs.push_back(slots.getUnchecked(0));
-                }
+        for (auto channel = buffer.getNumChannels(); --channel > 0;)
+            FloatVectorOperations::copyWithMultiply(buffer.getWritePointer(channel, startSample), monoBuffer, gains[channel % 2], numSamples);
 
-                break;
-            }
-            case Waveform::LP_Jam_Block:
-            case Waveform::Fire:
-            {
-                checkNodeIfExist();
+        FloatVectorOperations::multiply(monoBuffer, gains[0], numSamples);
+    }
 
-                if (shouldAddNode)
-                {
-                    slots.set(0, mainProcessor->addNode(std::make_unique<AudioFileProcessor>(processorChoices[waveformIndex], musicMetre, formatManager)));
-                    processorNodePtrs.push_back(slots.getUnchecked(0));
-                }
+    // the categories may keep the sound of the beat, which is what they start with
+    static StringArray getCategoryChoices()
+    {
+        StringArray choices { "Same" };
+        choices.addArray(SampleTable::getSoundNames());
+        return choices;
+    }
 
-                break;
-            }
-            default:
-                jassertfalse;
-                break;
+    // Renders the sound of every pulse into the first channel. The click sounds are shaped by the
+    // pulse's tail; a voice is a word, longer than a click, so it plays to its end or the next onset
+    // and fades out over the last few milliseconds before either.
+    void renderPulses(float* monoBuffer, int numSamples)
+    {
+        for (auto i = 0; i < numSamples; ++i)
+        {
+            auto pulseSample = musicMetre.getPulseSample(*this);
+
+            // the Metre resets this processor before it moves on, so the new step is known only now
+            if (isOnset)
+                startSound();
+
+            monoBuffer[i] = pool != nullptr ? PulseLoop::renderSample(*pool, pulseSound, currentIndex++, pulseSample) : 0.0f;
         }
+    }
 
-        if (hasChanged)
-        {
-            for (auto connection : mainProcessor->getConnections())
-                mainProcessor->removeConnection(connection);
+    // from sampleInPulse on, to pick the sound up again where the loop left it
+    void startSound(int sampleInPulse = 0)
+    {
+        isOnset = false;
+        sampleTable.adoptLatest(pool);
 
-            ReferenceCountedArray<Node> activeSlots;
+        pulseSound = pool != nullptr ? PulseLoop::getPulseSound(musicMetre.getCurrentStep(), musicMetre.getPlayingBaseNoteValue(), *pool, getVoicing(),
+                                                               musicMetre.getPulseLength())
+                                     : PulseLoop::PulseSound {};
+        currentIndex = pulseSound.start + sampleInPulse;
+    }
 
-            for (auto slot : slots)
-            {
-                if (slot != nullptr)
-                {
-                    activeSlots.add(slot);
-
-                    slot->getProcessor()->setPlayConfigDetails(getMainBusNumInputChannels(),
-                                                               getMainBusNumOutputChannels(),
-                                                               getSampleRate(),
-                                                               getBlockSize());
-                }
-            }
+    // Copies the block from the loop while it is the bar that would be rendered live. The loop
+    // takes over where its pulse is as long as the playing one, which a pulse that started before
+    // a tempo change is not; a pulse the loop does not reach, e.g. one a clock follower nudged,
+    // plays on in silence as a click's tail would.
+    bool playLoop(float* monoBuffer, int numSamples)
+    {
+        auto wasPlayingLoop = isPlayingLoop;
+        isPlayingLoop = false;
 
-            if (activeSlots.isEmpty())
-            {
-                connectAudioNodes();
-            }
-            else
-            {
-                for (int i = 0; i < activeSlots.size() - 1; ++i)
-                {
-                    for (int channel = 0; channel < 2; ++channel)
-                        mainProcessor->addConnection({ { activeSlots.getUnchecked(i)->nodeID, channel },
-                                                       { activeSlots.getUnchecked(i + 1)->nodeID, channel } });
-                }
-
-                for (int channel = 0; channel < 2; ++channel)
-                {
-                    mainProcessor->addConnection({ { audioInputNode->nodeID, channel },
-                                                   { activeSlots.getFirst()->nodeID, channel } });
-                    mainProcessor->addConnection({ { activeSlots.getLast()->nodeID, channel },
-                                                   { audioOutputNode->nodeID, channel } });
-                }
-            }
+        if (pulseLoop.isEnabled())
+        {
+            pulseLoop.adoptLatest(loop);
+
+            // the sounds that are playing live keep their table until the next onset
+            auto latestPool = pool;
+            sampleTable.adoptLatest(latestPool);
+
+            isPlayingLoop = loop != nullptr && latestPool != nullptr
+                         && loop->matches(musicMetre.getPlayingPatternPointer(), musicMetre.getBPM(), latestPool.get(), getVoicing())
+                         && (wasPlayingLoop || musicMetre.getSampleInPulse() >= musicMetre.getPulseLength()
+                             || loop->stepLengths[(size_t) musicMetre.getCurrentStepIndex()] == musicMetre.getPulseLength());
 
-            for (auto node : mainProcessor->getNodes())
-                node->getProcessor()->enableAllBuses();
+            if (isPlayingLoop)
+                pool = latestPool;
         }
 
-        for (auto node : processorNodePtrs)
+        if (!isPlayingLoop)
         {
-            bool shouldBeBypassed = !mainProcessor->isConnected(audioInputNode->nodeID, node->nodeID);
-            node->setBypassed(shouldBeBypassed);
+            if (wasPlayingLoop)
+                startSound(musicMetre.getSampleInPulse());
+
+            return false;
         }
 
-        slot1Node = slots.getUnchecked(0);
+        auto* loopBuffer = loop->samples.getReadPointer(0);
+
+        musicMetre.advanceBlock(numSamples, [&](int stepIndex, int sampleInPulse, int sampleInBlock, int stretch) {
+            auto numRendered = jlimit(0, stretch, loop->stepLengths[(size_t) stepIndex] - sampleInPulse);
+
+            FloatVectorOperations::copy(monoBuffer + sampleInBlock, loopBuffer + loop->stepStarts[(size_t) stepIndex] + sampleInPulse, numRendered);
+            FloatVectorOperations::clear(monoBuffer + sampleInBlock + numRendered, stretch - numRendered);
+        });
+
+        return true;
     }
 
-    void connectAudioNodes()
+    // any thread; the choices that shape each pulse, as the live sound and the loop read them
+    PulseLoop::Voicing getVoicing() const
     {
-        for (int channel = 0; channel < 2; ++channel)
-            mainProcessor->addConnection({ { audioInputNode->nodeID, channel },
-                                           { audioOutputNode->nodeID, channel } });
+        PulseLoop::Voicing voicing;
+
+        for (size_t i = 0; i < soundParameters.size(); ++i)
+            voicing.sounds[i] = (int) soundParameters[i]->load();
+
+        voicing.subdivisionGain = Decibels::decibelsToGain(subdivisionLevelParameter->load());
+        voicing.accentDepth = accentParameter->load();
+
+        return voicing;
     }
 
     Music::Metre& musicMetre;
 
     AudioFormatManager formatManager;
+    SampleTable sampleTable { formatManager };
+
+    // the parameter's choices are read once, so a new template shows up after a restart
+    enum
+    {
+        straightGroove,
+        swingGroove
+    };
+
+    const std::vector<Music::Groove> grooveTemplates { loadGrooveTemplates() };
+
+    AudioProcessorValueTreeState parameters;
+
+    std::array<std::atomic<float>*, 4> soundParameters {};
+    std::atomic<float>* subdivisionLevelParameter = nullptr;
+    std::atomic<float>* gainParameter = nullptr;
+    std::atomic<float>* levelParameter = nullptr;
+    std::atomic<float>* accentParameter = nullptr;
+    std::atomic<float>* panParameter = nullptr;
+    std::atomic<float>* spreadParameter = nullptr;
+
+    // audio thread; where the current pulse sits in its beat, and so on which side it is spread
+    int pulseInBeat = 0;
+    float pulsePanOffset = 0.0f;
+
+    SmoothedValue<float> gainSmoother, levelSmoother;
 
-    StringArray processorChoices { "Sine", "LP_Jam_Block", "Fire" };
+    static constexpr int defaultRampSize = 512;
+    static constexpr int groovePollMilliseconds = 20;
 
-    std::vector<Node::Ptr> processorNodePtrs;
+    std::atomic<bool> grooveChanged { false }, blockPlayed { false };
 
-    std::unique_ptr<AudioProcessorGraph> mainProcessor;
+    HeapBlock<float> rampBuffer;
+    int rampBufferSize = 0;
 
-    AudioParameterChoice* processorSlot1;
+    // audio thread; the sample of the current pulse, as a stretch of the table it was picked from
+    SampleTable::Pool::Ptr pool;
+    PulseLoop::PulseSound pulseSound;
+    bool isOnset = true;
+    int currentIndex = 0;
 
-    Node::Ptr audioInputNode;
-    Node::Ptr audioOutputNode;
+    // declared after the parameters, so its thread stops before they go
+    PulseLoop pulseLoop { musicMetre, sampleTable, [this] { return getVoicing(); } };
 
-    Node::Ptr slot1Node;
+    // audio thread; the loop last adopted, and whether the previous block was copied from it
+    PulseLoop::Loop::Ptr loop;
+    bool isPlayingLoop = false;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SoundStallProcessor)
 };
@@ -0,0 +1,235 @@
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+// Records what each thread does, so a glitch can be traced across the audio thread, the message
+// thread and the rest. Every thread writes into a ring of its own without locking or allocating,
+// and the last events of all rings are written out as Chrome trace JSON, which chrome://tracing
+// and ui.perfetto.dev open. Until start() is called an event costs one atomic load.
+class TraceRecorder
+{
+public:
+    // times the scope it is created in; the name must outlive the recorder, e.g. a string literal
+    class ScopedEvent
+    {
+    public:
+        explicit ScopedEvent(const char* nameToUse, int64 valueToUse = 0)
+            : name(nameToUse), value(valueToUse), startTicks(isRecording() ? Time::getHighResolutionTicks() : 0)
+        {
+        }
+
+        ~ScopedEvent()
+        {
+            if (startTicks != 0)
+                write(name, startTicks, Time::getHighResolutionTicks() - startTicks, value);
+        }
+
+    private:
+        const char* name;
+        const int64 value, startTicks;
+
+        JUCE_DECLARE_NON_COPYABLE(ScopedEvent)
+    };
+
+    // a moment rather than a span, e.g. an onset
+    static void instant(const char* name, int64 value = 0)
+    {
+        if (isRecording())
+            write(name, Time::getHighResolutionTicks(), -1, value);
+    }
+
+    // shown as the name of the calling thread's track
+    static void setThreadName(const char* name)
+    {
+        if (isRecording())
+            if (auto* ring = getRing())
+                ring->threadName.store(name, std::memory_order_relaxed);
+    }
+
+    static bool isRecording() { return recording.load(std::memory_order_relaxed); }
+
+    static void start() { recording = true; }
+    static void stop() { recording = false; }
+
+    // may be called while recording; the events that are overwritten meanwhile are left out
+    static var createTrace()
+    {
+        Array<var> traceEvents;
+
+        for (auto i = 0; i < jmin(numRings.load(), maxThreads); ++i)
+        {
+            auto& ring = rings[(size_t) i];
+            auto threadIndex = i + 1;
+
+            // the events before the current owner's first belong to a thread that has ended
+            auto end = ring.numWritten.load(std::memory_order_acquire);
+            auto begin = jmax(end > (uint64) ringSize ? end - (uint64) ringSize : (uint64) 0,
+                              ring.firstEvent.load(std::memory_order_acquire));
+
+            std::vector<Event> events;
+
+            for (auto n = begin; n < end; ++n)
+                events.push_back(ring.events[(size_t) (n % ringSize)]);
+
+            // the writer may be halfway through event number "overwritten", whose slot held the
+            // event a ring's length before it
+            auto overwritten = ring.numWritten.load(std::memory_order_acquire);
+            auto firstValid = overwritten >= (uint64) ringSize ? overwritten - (uint64) ringSize + 1 : (uint64) 0;
+
+            for (auto n = jmax(begin, firstValid); n < end; ++n)
+            {
+                auto& event = events[(size_t) (n - begin)];
+                auto* traceEvent = new DynamicObject();
+
+                traceEvent->setProperty("name", event.name);
+                traceEvent->setProperty("pid", 1);
+                traceEvent->setProperty("tid", threadIndex);
+                traceEvent->setProperty("ts", toMicroseconds(event.startTicks));
+
+                if (event.durationTicks >= 0)
+                {
+                    traceEvent->setProperty("ph", "X");
+                    traceEvent->setProperty("dur", toMicroseconds(event.durationTicks));
+                }
+                else
+                {
+                    traceEvent->setProperty("ph", "i");
+                    traceEvent->setProperty("s", "t");
+                }
+
+                auto* arguments = new DynamicObject();
+                arguments->setProperty("value", event.value);
+                traceEvent->setProperty("args", arguments);
+
+                traceEvents.add(traceEvent);
+            }
+
+            auto* threadName = ring.threadName.load(std::memory_order_relaxed);
+
+            auto* metadata = new DynamicObject();
+            metadata->setProperty("name", "thread_name");
+            metadata->setProperty("ph", "M");
+            metadata->setProperty("pid", 1);
+            metadata->setProperty("tid", threadIndex);
+
+            auto* arguments = new DynamicObject();
+            arguments->setProperty("name", threadName != nullptr ? String(threadName) : "Thread " + String(threadIndex));
+            metadata->setProperty("args", arguments);
+
+            traceEvents.add(metadata);
+        }
+
+        auto* trace = new DynamicObject();
+        trace->setProperty("traceEvents", traceEvents);
+        trace->setProperty("displayTimeUnit", "ms");
+
+        return trace;
+    }
+
+    static bool writeTrace(const File& file)
+    {
+        file.getParentDirectory().createDirectory();
+        return file.replaceWithText(JSON::toString(createTrace(), true));
+    }
+
+    static File getDefaultTraceFile()
+    {
+        return File::getSpecialLocation(File::userApplicationDataDirectory)
+            .getChildFile(ProjectInfo::projectName)
+            .getChildFile("Trace " + Time::getCurrentTime().formatted("%Y-%m-%d %H-%M-%S") + ".json");
+    }
+
+private:
+    struct Event
+    {
+        const char* name;
+        int64 startTicks;
+        int64 durationTicks;
+        int64 value;
+    };
+
+    static constexpr int maxThreads = 16;
+    static constexpr int ringSize = 4096;
+
+    struct Ring
+    {
+        std::atomic<const char*> threadName { nullptr };
+        std::array<Event, ringSize> events;
+        std::atomic<uint64> numWritten { 0 };
+
+        // the number of the first event written by the thread holding the ring
+        std::atomic<uint64> firstEvent { 0 };
+        std::atomic<bool> inUse { false };
+    };
+
+    // held by every thread that has recorded, so its ring is free again once the thread ends, e.g.
+    // the audio thread of a device that has been restarted
+    struct RingClaim
+    {
+        RingClaim() : ring(claimRing()) {}
+
+        ~RingClaim()
+        {
+            if (ring != nullptr)
+                ring->inUse.store(false, std::memory_order_release);
+        }
+
+        Ring* const ring;
+    };
+
+    static double toMicroseconds(int64 ticks)
+    {
+        return 1.0e6 * Time::highResolutionTicksToSeconds(ticks);
+    }
+
+    // the owning thread is the only writer of its ring
+    static void write(const char* name, int64 startTicks, int64 durationTicks, int64 value)
+    {
+        if (auto* ring = getRing())
+        {
+            auto n = ring->numWritten.load(std::memory_order_relaxed);
+            ring->events[(size_t) (n % ringSize)] = { name, startTicks, durationTicks, value };
+            ring->numWritten.store(n + 1, std::memory_order_release);
+        }
+    }
+
+    // the first event of a thread claims a ring for it, while one is free
+    static Ring* getRing()
+    {
+        thread_local RingClaim claim;
+        return claim.ring;
+    }
+
+    // unused rings go first, so the events of an ended thread stay in the trace for as long as they can
+    static Ring* claimRing()
+    {
+        auto index = numRings.fetch_add(1);
+
+        if (index < maxThreads && takeRing(rings[(size_t) index]))
+            return &rings[(size_t) index];
+
+        for (auto& ring : rings)
+            if (takeRing(ring))
+                return &ring;
+
+        return nullptr;
+    }
+
+    static bool takeRing(Ring& ring)
+    {
+        auto expected = false;
+
+        if (!ring.inUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+            return false;
+
+        ring.threadName = MessageManager::existsAndIsCurrentThread() ? "Message Thread" : nullptr;
+        ring.firstEvent.store(ring.numWritten.load(std::memory_order_relaxed), std::memory_order_release);
+
+        return true;
+    }
+
+    // constant-initialised, so there is nothing to construct on the first event
+    inline static std::atomic<bool> recording { false };
+    inline static std::atomic<int> numRings { 0 };
+    inline static std::array<Ring, maxThreads> rings {};
+};